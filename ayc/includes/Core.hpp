@@ -8,6 +8,8 @@
 #ifndef CORE_HPP
 #define	CORE_HPP
 
+#include <cstdint>
+#include <limits>
 #include <vector>
 
 #include <boost/bind.hpp>
@@ -16,11 +18,17 @@
 #include <boost/range/irange.hpp>
 #include <boost/ref.hpp>
 
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+
 
 #define cimg_OS 0
 #include "CImg.h"
 using namespace cimg_library;
 
+#include "HugePageAllocator.hpp"
+
 const float PI = 3.14159265f;
 const float MAX_IMAGE_SIZE = 4000000.0f;
 const float BLUR = 1.2f;
@@ -45,6 +53,9 @@ const float CIRCLE_FILTER_THRESHOLD = 0.95;
 const float RADIAN_FILTER_THRESHOLD = 0.9;
 const float TEMPLATE_FILTER_THRESHOLD = 0.9;
 
+// Horizontally adjacent centers the circle filter evaluates together.
+const int SIMD_CENTERS = 16;
+
 struct Point {
     int x;
     int y;
@@ -66,33 +77,365 @@ typedef std::vector<Descriptors> DescriptorsVector;
 
 float point2float(const Point& p, const Point& c, const Image& i);
 
+/*
+ * How a scene pixel in [0, 1] is stored for the scan and summed by the kernels:
+ * float as is, or fixed point in the full range of an unsigned integer type,
+ * summed in int and scaled back to [0, 1] once per sample. Fixed point is lossy:
+ * the scene is blurred float, so even u16 rounds it to steps of 1/65535, and u8
+ * to steps of 1/255.
+ */
+template<class Pixel>
+struct PixelTraits {
+    typedef float Sum;
 
-template<class OutputIterator>
-void generateScales(const Image& query, float minScale, float maxScale, OutputIterator out) {
-    float diff = (maxScale - minScale) / (SCALES_NUMBER - 1);
-    boost::for_each(boost::irange(0, SCALES_NUMBER), [&](int i) {
-        int factor = -std::floor((minScale + diff * i) * 100);
-        *out++ = query.get_resize(factor, factor);
-    });
+    static Pixel quantize(float value) {
+        return value;
+    }
+
+    static float scale() {
+        return 1;
+    }
+};
+
+template<class Pixel>
+struct FixedPointTraits {
+    typedef int Sum;
+
+    static Pixel quantize(float value) {
+        return std::lround(std::min(std::max(value, 0.0f), 1.0f) * std::numeric_limits<Pixel>::max());
+    }
+
+    static float scale() {
+        return 1.0f / std::numeric_limits<Pixel>::max();
+    }
+};
+
+template<>
+struct PixelTraits<uint16_t> : FixedPointTraits<uint16_t> {
+};
+
+template<>
+struct PixelTraits<uint8_t> : FixedPointTraits<uint8_t> {
+};
+
+/*
+ * The value a scene pixel is scanned as once stored as Pixel, for the paths that
+ * read the float scene but have to agree with the kernels.
+ */
+template<class Pixel>
+float storedValue(float value) {
+    return PixelTraits<Pixel>::quantize(value) * PixelTraits<Pixel>::scale();
 }
 
-template<class SinglePassRange, class OutputIterator>
-void generateQueryRotations(const SinglePassRange& queries, OutputIterator out) {
-    boost::for_each(queries, [&](const Image & image) {
-        auto inserter = std::back_inserter(*out++);
-        boost::for_each(boost::irange(0, FULL_DEGREES, ROTATION_ANGLE), [&](int angle) {
-            inserter = image.get_rotate(angle).blur(BLUR);
+/*
+ * Scene rows [firstRow, lastRow) cut into bands of bandRows rows, the last one
+ * possibly shorter. A band is handed to the workers as row ranges through an
+ * affinity_partitioner shared by all bands of its length, so row k of any band
+ * goes to the same worker each time. The scan buffers are filled and scanned
+ * through the same bands: the worker that scans a row is the one that first
+ * wrote its pages, and first-touch places them on its NUMA node.
+ */
+class RowBands {
+public:
+
+    RowBands(int firstRow, int lastRow, int bandRows) : firstRow(firstRow), lastRow(lastRow), bandRows(std::max(bandRows, 1)) {
+    }
+
+    int count() const {
+        return std::max(lastRow - firstRow + bandRows - 1, 0) / bandRows;
+    }
+
+    int top(int band) const {
+        return firstRow + band * bandRows;
+    }
+
+    int bottom(int band) const {
+        return std::min(top(band) + bandRows, lastRow);
+    }
+
+    /*
+     * Runs body(const tbb::blocked_range<int>& rows) over the rows of one band.
+     */
+    template<class Body>
+    void forBand(int band, const Body& body) {
+        tbb::parallel_for(tbb::blocked_range<int>(top(band), bottom(band)), body, bottom(band) - top(band) == bandRows ? fullBand : lastBand);
+    }
+
+    /*
+     * Runs row(y) for every y in [first, last), band by band; the rows outside
+     * the bands (borders, halos) in a plain parallel pass.
+     */
+    template<class Body>
+    void forRows(int first, int last, const Body& row) {
+        tbb::parallel_for(first, std::min(firstRow, last), row);
+        for (int band = 0; band < count(); ++band) {
+            forBand(band, [&](const tbb::blocked_range<int>& rows) {
+                for (int y = std::max(rows.begin(), first); y < std::min(rows.end(), last); ++y) {
+                    row(y);
+                }
+            });
+        }
+        tbb::parallel_for(std::max(lastRow, first), last, row);
+    }
+
+private:
+    int firstRow;
+    int lastRow;
+    int bandRows;
+    tbb::affinity_partitioner fullBand;
+    tbb::affinity_partitioner lastBand;
+};
+
+/*
+ * Scene copy for the scan: a zero border of at least border pixels on every side
+ * and rows of a 64-byte multiple, with pixel (0, 0) of each row cache-line aligned.
+ * Pixel (x, y) is at(Point(x, y))[0] and its neighbour (x + dx, y + dy) is
+ * dy * stride() + dx pixels away, so a filter that stays within border of a
+ * center needs neither bounds checks nor CImg's index arithmetic. The buffer
+ * comes from HugePageAllocator and is filled through the scan's bands, border
+ * included.
+ */
+template<class Pixel>
+class PaddedImage {
+public:
+    typedef Pixel PixelType;
+
+    /*
+     * What the sampling kernels read around one center.
+     */
+    struct Cursor {
+        typedef Pixel PixelType;
+
+        const Pixel* center;
+        int stride;
+
+        Pixel operator()(const Point& p) const {
+            return center[p.y * stride + p.x];
+        }
+    };
+
+    PaddedImage(const Image& image, int border, RowBands& bands) : imageWidth(image.width()), imageHeight(image.height()) {
+        const int linePixels = 64 / sizeof (Pixel);
+        int left = (border + linePixels - 1) / linePixels * linePixels;
+        rowStride = (left + imageWidth + border + linePixels - 1) / linePixels * linePixels;
+        origin = border * rowStride + left;
+        pixels.resize(static_cast<size_t> (rowStride) * (imageHeight + 2 * border));
+        // Every row, borders included, is written once here, by the worker that will scan it.
+        bands.forRows(-border, imageHeight + border, [&](int y) {
+            Pixel* row = pixels.data() + origin - left + static_cast<ptrdiff_t> (y) * rowStride;
+            std::fill(row, row + rowStride, 0);
+            if (y >= 0 && y < imageHeight) {
+                std::transform(image.data(0, y), image.data(0, y) + imageWidth, row + left, PixelTraits<Pixel>::quantize);
+            }
+        });
+    }
+
+    int width() const {
+        return imageWidth;
+    }
+
+    int height() const {
+        return imageHeight;
+    }
+
+    int stride() const {
+        return rowStride;
+    }
+
+    const Pixel* at(const Point& p) const {
+        return pixels.data() + origin + p.y * rowStride + p.x;
+    }
+
+    Cursor cursor(const Point& center) const {
+        return Cursor{at(center), rowStride};
+    }
+
+private:
+    int imageWidth;
+    int imageHeight;
+    int rowStride;
+    int origin;
+    std::vector<Pixel, HugePageAllocator<Pixel> > pixels;
+};
+
+/*
+ * Same zero-bordered scene as PaddedImage, stored as TILE_SIZE x TILE_SIZE tiles
+ * in row-major tile order, each tile row-major inside: a ring around a center
+ * touches a few tiles per octant instead of one cache line (and often one page)
+ * per row it crosses. Addressing costs a few shifts and masks per pixel.
+ */
+template<class Pixel>
+class TiledImage {
+public:
+    typedef Pixel PixelType;
+
+    static const int TILE_SHIFT = 3;
+    static const int TILE_SIZE = 1 << TILE_SHIFT;
+    static const int TILE_MASK = TILE_SIZE - 1;
+
+    struct Cursor {
+        typedef Pixel PixelType;
+
+        const TiledImage* image;
+        int x;
+        int y;
+
+        Pixel operator()(const Point& p) const {
+            return image->pixel(x + p.x, y + p.y);
+        }
+    };
+
+    TiledImage(const Image& image, int border, RowBands& bands) : imageWidth(image.width()), imageHeight(image.height()) {
+        origin = (border + TILE_MASK) & ~TILE_MASK;
+        int columns = (origin + imageWidth + border + TILE_MASK) >> TILE_SHIFT;
+        int rows = (origin + imageHeight + border + TILE_MASK) >> TILE_SHIFT;
+        tileRowSize = columns << (2 * TILE_SHIFT);
+        pixels.resize(static_cast<size_t> (tileRowSize) * rows);
+        // Filled image row by image row through the scan's bands, like PaddedImage.
+        // The rows of a tile row share pages, which go to whichever of their
+        // workers writes first: the scanning one unless a row range ends mid-tile.
+        bands.forRows(-origin, (rows << TILE_SHIFT) - origin, [&](int y) {
+            int padded = columns << TILE_SHIFT;
+            for (int x = 0; x < padded; ++x) {
+                int imageX = x - origin;
+                bool inside = y >= 0 && y < imageHeight && imageX >= 0 && imageX < imageWidth;
+                pixels[index(x, origin + y)] = inside ? PixelTraits<Pixel>::quantize(*image.data(imageX, y)) : 0;
+            }
         });
+    }
+
+    int width() const {
+        return imageWidth;
+    }
+
+    int height() const {
+        return imageHeight;
+    }
+
+    Cursor cursor(const Point& center) const {
+        return Cursor{this, origin + center.x, origin + center.y};
+    }
+
+    /*
+     * Pixel at padded coordinates, (0, 0) being origin pixels above and left of the image.
+     */
+    Pixel pixel(int x, int y) const {
+        return pixels[index(x, y)];
+    }
+
+private:
+
+    size_t index(int x, int y) const {
+        return static_cast<size_t> (y >> TILE_SHIFT) * tileRowSize + ((x >> TILE_SHIFT) << (2 * TILE_SHIFT)) +
+                ((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK);
+    }
+
+    int imageWidth;
+    int imageHeight;
+    int origin;
+    int tileRowSize;
+    std::vector<Pixel, HugePageAllocator<Pixel> > pixels;
+};
+
+/*
+ * Area-averaging (box filter) resampling along one axis: target pixel i is the
+ * mean of the source interval it covers, with partial pixels weighted by their
+ * overlap. Weights are stored per target pixel, first[i] being the first source
+ * pixel and offset[i]..offset[i + 1] its slice of weights.
+ */
+struct ResampleAxis {
+    std::vector<int> first;
+    std::vector<int> offset;
+    std::vector<float> weights;
+
+    ResampleAxis(int source, int target);
+
+    int size() const {
+        return first.size();
+    }
+};
+
+void resampleRow(const ResampleAxis& axis, const float* source, float* target);
+void accumulateRow(const float* source, float weight, int width, float* target);
+
+/*
+ * Anti-aliased replacement for CImg::get_resize(), separable and parallel over rows.
+ */
+Image areaResize(const Image& image, int width, int height);
+
+/*
+ * Same 0-order Deriche filter as CImg::blur(sigma), run on blocks of BLUR_LANES
+ * columns (rows are transposed into a block first) so every step is a
+ * contiguous vector operation, with the blocks spread over TBB.
+ */
+void recursiveBlur(Image& image, float sigma);
+
+/*
+ * The two passes of recursiveBlur(): blurRows() filters rows [first, last) along
+ * x, blurColumns() the whole image along y. Rows can be filtered as soon as they
+ * are final, while they are still in cache.
+ */
+void blurRows(Image& image, int first, int last, float sigma);
+void blurColumns(Image& image, float sigma);
+
+/*
+ * areaResize() and recursiveBlur() in one sweep over the output: each block of
+ * rows is accumulated and x-filtered in cache, only the column pass reads it again.
+ */
+Image areaResizeBlur(const Image& image, int width, int height, float sigma);
+
+/*
+ * Octave pyramid for scale generation: image halved by area averaging, then each
+ * level halved again, for as long as the result stays at least width x height.
+ * A scale taken from the smallest level that still covers it reads at most four
+ * source pixels per output pixel and is still properly band-limited.
+ */
+std::vector<Image> halvingPyramid(const Image& image, int width, int height);
+
+/*
+ * Size of a CImg percent resize (negative size arguments).
+ */
+inline int scaledSize(int size, int percent) {
+    return std::max(percent * size / 100, 1);
+}
+
+
+/*
+ * The query model is built with tbb::parallel_for over scales (and rotations),
+ * so the generators below take random access ranges and write every element
+ * to its own slot, in the same order a serial loop would.
+ */
+template<class RandomAccessIterator>
+void generateScales(const Image& query, float minScale, float maxScale, RandomAccessIterator out) {
+    float diff = (maxScale - minScale) / (SCALES_NUMBER - 1);
+    int percents[SCALES_NUMBER];
+    for (int i = 0; i < SCALES_NUMBER; ++i) {
+        percents[i] = std::floor((minScale + diff * i) * 100);
+    }
+    int smallest = *std::min_element(percents, percents + SCALES_NUMBER);
+    std::vector<Image> pyramid = halvingPyramid(query, scaledSize(query.width(), smallest), scaledSize(query.height(), smallest));
+    tbb::parallel_for(0, SCALES_NUMBER, [&](int i) {
+        int width = scaledSize(query.width(), percents[i]);
+        int height = scaledSize(query.height(), percents[i]);
+        const Image* source = &query;
+        for (const Image& level : pyramid) {
+            if (level.width() >= width && level.height() >= height) {
+                source = &level;
+            }
+        }
+        out[i] = areaResizeBlur(*source, width, height, BLUR);
     });
 }
 
 void generateCircle(int radius, const Point& center, Points& circle);
 
-template <class SinglePassRange, class OutputIterator>
-void generateCirclesSet(const SinglePassRange& queries, OutputIterator out) {
-    boost::for_each(queries, [&](const Image & image) {
-        auto featuresOut = std::begin(*out++);
-        auto maxRadius = std::min(std::min(image.height(), image.width()) / 2, MAX_CIRCLE_RADIUS);
+template <class RandomAccessRange, class RandomAccessIterator>
+void generateCirclesSet(const RandomAccessRange& queries, RandomAccessIterator out) {
+    tbb::parallel_for(0, static_cast<int> (boost::size(queries)), [&](int q) {
+        const Image& image = queries[q];
+        auto featuresOut = std::begin(out[q]);
+        // The outermost ring has to stay inside the image around its center pixel.
+        auto maxRadius = std::min((std::min(image.height(), image.width()) - 1) / 2, MAX_CIRCLE_RADIUS);
         auto diff = std::max(maxRadius / CIRCLES_NUMBER, 1);
         boost::for_each(boost::irange(1, CIRCLES_NUMBER + 1), [&](int i) {
             int radius = std::min(i * diff, maxRadius);
@@ -103,11 +446,13 @@ void generateCirclesSet(const SinglePassRange& queries, OutputIterator out) {
 
 void generateRadianLine(int angle, int radius, const Point& center, Points& radianLine);
 
-template <class SinglePassRange, class OutputIterator>
-void generateRadianSet(const SinglePassRange& queries, OutputIterator out) {
-    boost::for_each(queries, [&](const Image & image) {
-        auto featuresOut = std::begin(*out++);
-        auto radius = std::min(std::min(image.height(), image.width()) / 2, MAX_CIRCLE_RADIUS);
+template <class RandomAccessRange, class RandomAccessIterator>
+void generateRadianSet(const RandomAccessRange& queries, RandomAccessIterator out) {
+    tbb::parallel_for(0, static_cast<int> (boost::size(queries)), [&](int q) {
+        const Image& image = queries[q];
+        auto featuresOut = std::begin(out[q]);
+        // Same bound as the circles: the line ends inside the image around its center pixel.
+        auto radius = std::min((std::min(image.height(), image.width()) - 1) / 2, MAX_CIRCLE_RADIUS);
                 radius = (radius / CIRCLES_NUMBER) * CIRCLES_NUMBER;
                 boost::for_each(boost::irange(0, FULL_DEGREES, ROTATION_ANGLE), [&](int angle) {
                     generateRadianLine(angle, radius, Point(0, 0), *featuresOut++);
@@ -115,23 +460,53 @@ void generateRadianSet(const SinglePassRange& queries, OutputIterator out) {
     });
 }
 
-template<class SinglePassRange, class OutputIterator>
-void generatePointSet(const SinglePassRange& queriesRotations, OutputIterator out) {
-    boost::for_each(queriesRotations, [&](const std::vector<Image>& rotations) {
-        auto featuresOut = std::begin(*out++);
-        boost::for_each(rotations, [&](const Image & image) {
-            auto inserter = std::back_inserter(*featuresOut++);
-            auto c = Point(image.width() / 2, image.height() / 2);
-            cimg_forXY(image, x, y) {
-                if (image(x, y) != 0) {
-                    inserter = Point(x - c.x, y - c.y);
-                }
-            }
-        });
+/*
+ * Pixel grid of CImg::get_rotate(angle) with linear interpolation and zero
+ * boundary: its size and, for pixel (x, y), the source position
+ * (x0 + x * ca + y * sa, y0 - x * sa + y * ca). Orthogonal angles are exact
+ * remaps, as in CImg.
+ */
+struct RotatedGrid {
+    int width;
+    int height;
+    float ca;
+    float sa;
+    float x0;
+    float y0;
+
+    RotatedGrid(const Image& image, int angle);
+};
+
+/*
+ * Template of image rotated on grid, sampled straight from image instead of a
+ * rotated copy: the grid pixels whose source lies inside image, relative to the
+ * grid center, and the bilinear values there. Blurring image first stands in for
+ * blurring the rotated copy, the Gaussian being isotropic.
+ */
+void sampleRotatedTemplate(const Image& image, const RotatedGrid& grid, Points& points, Descriptor& values);
+
+/*
+ * ROTATIONS_NUMBER templates per (blurred) query scale; grids receive the
+ * rotated sizes.
+ */
+template<class RandomAccessRange, class GridIterator, class FeaturesIterator, class DescriptorsIterator>
+void generateTemplates(const RandomAccessRange& queries, GridIterator grids, FeaturesIterator points, DescriptorsIterator values) {
+    tbb::parallel_for(0, static_cast<int> (boost::size(queries)) * ROTATIONS_NUMBER, [&](int k) {
+        int i = k / ROTATIONS_NUMBER;
+        int r = k % ROTATIONS_NUMBER;
+        RotatedGrid grid(queries[i], r * ROTATION_ANGLE);
+        sampleRotatedTemplate(queries[i], grid, points[i][r], values[i][r]);
+        grids[i][r] = grid;
     });
 }
 
+/*
+ * 0.299 R + 0.587 G + 0.114 B scaled to [0, 1]; one- and two-channel input is
+ * taken as gray. convert2Gray() reads planar CImg channels, convertRow2Gray() an
+ * interleaved row, and both give the same values.
+ */
 void convert2Gray(const CImg<u_char>& colorImage, Image& grayImage);
+void convertRow2Gray(const u_char* pixels, int width, int channels, float* gray);
 
 float evalSample(const Points& points, const Point& center, const Image& image);
 
@@ -140,59 +515,124 @@ void evalQueryFeaturesSampleDescriptor(const Features& points, const Image& i, O
     boost::transform(points, out, boost::bind<float>(evalSample, _1, Point(i.width() / 2, i.height() / 2), boost::cref(i)));
 }
 
-template<class OutputIterator> 
-void evalPointDescriptor(const Points& points, const Point& p, const Image& image, OutputIterator out) {
-    boost::transform(points, out, boost::bind<float>(point2float, _1, boost::cref(p), boost::cref(image)));
+/*
+ * Scene-side sampling through the cursor of a PaddedImage or TiledImage, in
+ * [0, 1] whatever the pixel type.
+ */
+template<class Cursor>
+float evalSample(const Points& points, const Cursor& cursor) {
+    typedef typename Cursor::PixelType Pixel;
+    typename PixelTraits<Pixel>::Sum sum = 0;
+    for (const Point& p : points) {
+        sum += cursor(p);
+    }
+    return sum * PixelTraits<Pixel>::scale();
 }
 
-
-template <class ImageInputIterator, class OutputIterator>
-void evalQueryFeaturesPointDescriptor(const Features& features, ImageInputIterator images, OutputIterator out) {
-    boost::for_each(features, [&](const Points& points) {
-        auto image = *images++;
-        evalPointDescriptor(points, Point(image.width() / 2, image.height() / 2), image, std::back_inserter(*out++));
-    });
+template<class Cursor, class OutputIterator>
+void evalPointDescriptor(const Points& points, const Cursor& cursor, OutputIterator out) {
+    for (const Point& p : points) {
+        *out++ = cursor(p) * PixelTraits<typename Cursor::PixelType>::scale();
+    }
 }
 
-template<class InputImageIterator, class OutputIterator>
-void evalQueryDescriptors(const FeaturesVector& featureSet, InputImageIterator images, OutputIterator out) {
-    boost::for_each(featureSet, [&](const Features & features) {
-        evalQueryFeaturesSampleDescriptor(features, *images++, std::begin(*out++));
-    });
+template<class Cursor, class OutputIterator>
+void evalSampleDescriptor(const Features& features, const Cursor& cursor, OutputIterator out) {
+    for (const Points& points : features) {
+        *out++ = evalSample(points, cursor);
+    }
 }
 
-template<class InputImageIterator, class OutputIterator>
-void evalQueryTemplateDescriptors(const FeaturesVector& featureSet, InputImageIterator images, OutputIterator out) {
-    boost::for_each(featureSet, [&](const Features & features) {
-        evalQueryFeaturesPointDescriptor(features, std::begin(*images++),  std::begin(*out++));
-    });
-}
+/*
+ * A FeaturesVector compiled for one PaddedImage stride, in CSR form: point
+ * (dx, dy) becomes the linear offset dy * stride + dx, and the offsets of each
+ * scale form one contiguous block, feature after feature.
+ */
+class OffsetTable {
+public:
+    OffsetTable(const FeaturesVector& featureSet, int stride);
+
+    const int* begin(int scale, int feature) const {
+        return offsets.data() + starts[firstFeature[scale] + feature];
+    }
 
+    const int* end(int scale, int feature) const {
+        return offsets.data() + starts[firstFeature[scale] + feature + 1];
+    }
 
-bool isFitImage(float r, const Image& i, const Point& c);
-float getMaxRadius(const Features& f);
+private:
+    std::vector<int> firstFeature;
+    std::vector<int> starts;
+    std::vector<int> offsets;
+};
 
-template<class OutputIterator, class Functor>
-void evalFeaturesSampleDescriptor(const Features& features, const Image& i, const Point& c, OutputIterator out, Functor f) {
-    if (isFitImage(getMaxRadius(features), i, c)) {
-        boost::transform(features, out, boost::bind<float>(f, _1, c, boost::cref(i)));
+/*
+ * The circles of a circle set with duplicates merged: rings holds each distinct
+ * point list once, and index[scale][i] is the ring of circle i of that scale.
+ * Scales and queries mostly share radii, so rings is far shorter than the set.
+ */
+struct DistinctRings {
+    Features rings;
+    std::vector<std::vector<int> > index;
+
+    DistinctRings(const FeaturesVector& circleSet);
+};
+
+/*
+ * Points a sliding update of points' sum touches when the center moves by +1 in
+ * x: those entering plus those leaving. For generateCircle() rings this is
+ * about 1.4 times the ring itself, so rings are summed directly at every center.
+ */
+int countSlidingPoints(const Points& points);
+
+template<class Pixel>
+float evalSample(const int* first, const int* last, const Pixel* center) {
+    typename PixelTraits<Pixel>::Sum sum = 0;
+    for (; first != last; ++first) {
+        sum += center[*first];
     }
+    return sum * PixelTraits<Pixel>::scale();
+}
 
+/*
+ * evalSample() at the SIMD_CENTERS centers center, center + 1, ... of one row:
+ * each offset is a contiguous load across the block, so the lane loop fills a
+ * whole vector register (two with AVX2, one with AVX-512 or MIC).
+ */
+template<class Pixel>
+void evalSampleBlock(const int* first, const int* last, const Pixel* center, float* out) {
+    typename PixelTraits<Pixel>::Sum sums[SIMD_CENTERS] = {};
+    for (; first != last; ++first) {
+        const Pixel* pixels = center + *first;
+        for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+            sums[lane] += pixels[lane];
+        }
+    }
+    for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+        out[lane] = sums[lane] * PixelTraits<Pixel>::scale();
+    }
 }
 
-template<class OutputIterator, class Functor>
-void evalDescriptors(const FeaturesVector& featureSet, const Image& image, const Point& center, OutputIterator out, Functor f) {
-    boost::for_each(featureSet, [&](const Features & features) {
-        evalFeaturesSampleDescriptor(features, image, center, std::begin(*out++), f);
+
+template<class RandomAccessImageIterator, class RandomAccessIterator>
+void evalQueryDescriptors(const FeaturesVector& featureSet, RandomAccessImageIterator images, RandomAccessIterator out) {
+    tbb::parallel_for(0, static_cast<int> (featureSet.size()), [&](int i) {
+        evalQueryFeaturesSampleDescriptor(featureSet[i], images[i], std::begin(out[i]));
     });
 }
 
-template<class InputImagesIterator, class OutputIterator>
-void evalQueryRadianDescriptorsVector(const FeaturesVector& featureSet, InputImagesIterator images, OutputIterator out) {
+/*
+ * Farthest any point of features lies from its center along x or y.
+ */
+int getFeaturesReach(const Features& features);
+
+template<class RandomAccessImageIterator, class RandomAccessIterator>
+void evalQueryRadianDescriptorsVector(const FeaturesVector& featureSet, RandomAccessImageIterator images, RandomAccessIterator out) {
     Descriptors radianDescriptors(featureSet.size(), Descriptor(ROTATIONS_NUMBER));
     evalQueryDescriptors(featureSet, images, std::begin(radianDescriptors));
-    boost::for_each(radianDescriptors, [&](const Descriptor & d) {
-        auto DescriptorsOut = std::begin(*out++);
+    tbb::parallel_for(0, static_cast<int> (radianDescriptors.size()), [&](int i) {
+        const Descriptor& d = radianDescriptors[i];
+        auto DescriptorsOut = std::begin(out[i]);
         boost::for_each(boost::irange(0, ROTATIONS_NUMBER), [&](int r) {
             boost::rotate_copy(d, std::begin(d) + r, std::back_inserter(*DescriptorsOut++));
         });
@@ -201,6 +641,13 @@ void evalQueryRadianDescriptorsVector(const FeaturesVector& featureSet, InputIma
 
 float evalCorrelation(const Descriptor& x, const Descriptor& y);
 
+/*
+ * evalCorrelation(x, y) against SIMD_CENTERS descriptors stored lane by lane,
+ * y[i * SIMD_CENTERS + lane] being element i of descriptor lane. The beta and
+ * gamma bounds are applied as masks: rejected lanes get 0.
+ */
+void evalCorrelationBlock(const Descriptor& x, const float* y, float* out);
+
 void generateQueries(const Image& pattern, std::vector<std::vector<Image> >& queries, int maxScale);
 void generateRotations(const Image& pattern, std::vector<Image>& rotations);
 
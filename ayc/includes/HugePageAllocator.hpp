@@ -0,0 +1,114 @@
+/*
+ * File:   HugePageAllocator.hpp
+ * Author: stasstels
+ *
+ * Created on December 14, 2013, 6:05 PM
+ */
+
+#ifndef HUGEPAGEALLOCATOR_HPP
+#define	HUGEPAGEALLOCATOR_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+
+#include <sys/mman.h>
+
+const std::size_t HUGE_PAGE_SIZE = 2 << 20;
+
+/*
+ * Anonymous mapping for the big scan buffers. From HUGE_PAGE_SIZE up the length
+ * is rounded to whole huge pages and the range is backed by transparent huge
+ * pages, or with AYC_HUGE_PAGES=explicit by hugetlbfs pages when the pool has
+ * them. Nothing is touched here: a page lands on the NUMA node of the thread
+ * that first writes it, which RowBands makes the thread that scans it.
+ */
+inline std::size_t largeMappingSize(std::size_t size) {
+    return size < HUGE_PAGE_SIZE ? size : (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+inline void* mapLarge(std::size_t size) {
+    static const bool explicitPages = std::getenv("AYC_HUGE_PAGES") && !std::strcmp(std::getenv("AYC_HUGE_PAGES"), "explicit");
+    std::size_t length = largeMappingSize(size);
+    void* mapped = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (explicitPages && length >= HUGE_PAGE_SIZE) {
+        mapped = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (mapped == MAP_FAILED) {
+        mapped = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            return 0;
+        }
+#ifdef MADV_HUGEPAGE
+        if (length >= HUGE_PAGE_SIZE) {
+            madvise(mapped, length, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    return mapped;
+}
+
+inline void unmapLarge(void* data, std::size_t size) {
+    munmap(data, largeMappingSize(size));
+}
+
+/*
+ * Standard allocator over mapLarge(). Elements constructed without arguments
+ * are default-initialized, so a vector resized to n trivial elements leaves its
+ * pages untouched until a parallel fill writes them once.
+ */
+template<class T>
+class HugePageAllocator {
+public:
+    typedef T value_type;
+
+    template<class U>
+    struct rebind {
+        typedef HugePageAllocator<U> other;
+    };
+
+    HugePageAllocator() {
+    }
+
+    template<class U>
+    HugePageAllocator(const HugePageAllocator<U>&) {
+    }
+
+    T* allocate(std::size_t n) {
+        void* data = mapLarge(n * sizeof (T));
+        if (!data) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*> (data);
+    }
+
+    void deallocate(T* data, std::size_t n) {
+        unmapLarge(data, n * sizeof (T));
+    }
+
+    template<class U>
+    void construct(U* p) {
+        ::new (static_cast<void*> (p)) U;
+    }
+
+    template<class U, class... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*> (p)) U(std::forward<Args>(args)...);
+    }
+};
+
+template<class T, class U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+    return false;
+}
+
+#endif	/* HUGEPAGEALLOCATOR_HPP */
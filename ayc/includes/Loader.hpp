@@ -0,0 +1,44 @@
+/* 
+ * File:   Loader.hpp
+ * Author: stasstels
+ *
+ * Created on December 2, 2013, 9:20 PM
+ */
+
+#ifndef LOADER_HPP
+#define	LOADER_HPP
+
+#include <functional>
+
+#include "Core.hpp"
+
+/*
+ * Decodes JPEG and PNG files in-process (libjpeg/libpng) straight into a gray
+ * Image, one scanline at a time. Binary 8-bit PGM/PPM and uncompressed BMP are
+ * memory-mapped and converted from the mapped bytes. Any other format goes
+ * through CImg::load(), as do JPEG and PNG when built with AYC_NO_CODECS.
+ */
+Image readGrayImage(const char* filename);
+
+float getScaleRatio(int width, int height);
+
+/*
+ * Decodes the scene once and shrinks it to at most MAX_IMAGE_SIZE pixels before
+ * blurring. ratio receives the scale that was applied, which the query scales
+ * and the reported coordinates have to follow.
+ */
+Image readScene(const char* filename, float& ratio);
+
+typedef std::function<void(const Image& strip, int top, int firstRow, int lastRow)> StripScanner;
+
+/*
+ * Out-of-core variant for scenes scanned at full resolution: the scene is
+ * streamed in blurred horizontal strips of stripRows center rows. Each strip
+ * starts at scene row top and carries at least halo extra rows above and below
+ * its centers [firstRow, lastRow), so filters reaching up to halo pixels see the
+ * same neighbourhood as in the whole scene.
+ */
+void readSceneStrips(const char* filename, int stripRows, int halo, const StripScanner& scan);
+
+#endif	/* LOADER_HPP */
+
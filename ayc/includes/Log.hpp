@@ -0,0 +1,43 @@
+/* 
+ * File:   Log.hpp
+ * Author: stasstels
+ *
+ * Created on December 2, 2013, 9:14 PM
+ */
+
+#ifndef LOG_HPP
+#define	LOG_HPP
+
+#ifdef AYC_TIMING
+
+#include <chrono>
+#include <iostream>
+
+struct Log {
+    const char* msg;
+    std::chrono::steady_clock::time_point start;
+
+    Log(const char* msg) : msg(msg), start(std::chrono::steady_clock::now()) {
+    }
+
+    long long elapsed() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    ~Log() {
+        std::cerr << "Log: " << msg << " - " << elapsed() << " mcs" << std::endl;
+    }
+};
+
+#else
+
+struct Log {
+
+    Log(const char*) {
+    }
+};
+
+#endif
+
+#endif	/* LOG_HPP */
+
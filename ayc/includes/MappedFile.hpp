@@ -0,0 +1,51 @@
+/*
+ * File:   MappedFile.hpp
+ * Author: stasstels
+ *
+ * Created on December 5, 2013, 10:12 PM
+ */
+
+#ifndef MAPPEDFILE_HPP
+#define	MAPPEDFILE_HPP
+
+#include <cstddef>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Read-only private mapping of a whole file; data is null if mapping failed.
+ */
+class MappedFile {
+public:
+
+    MappedFile(int fd) : data(0), size(0) {
+        struct stat status;
+        if (fstat(fd, &status) || status.st_size <= 0) {
+            return;
+        }
+        void* mapped = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            return;
+        }
+        madvise(mapped, status.st_size, MADV_SEQUENTIAL);
+        data = static_cast<const unsigned char*> (mapped);
+        size = status.st_size;
+    }
+
+    ~MappedFile() {
+        if (data) {
+            munmap(const_cast<unsigned char*> (data), size);
+        }
+    }
+
+    const unsigned char* data;
+    std::size_t size;
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+#endif	/* MAPPEDFILE_HPP */
+
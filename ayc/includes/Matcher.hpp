@@ -0,0 +1,79 @@
+/*
+ * File:   Matcher.hpp
+ * Author: stasstels
+ *
+ * Created on December 6, 2013, 8:31 PM
+ */
+
+#ifndef MATCHER_HPP
+#define	MATCHER_HPP
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <tbb/concurrent_vector.h>
+
+#include "Core.hpp"
+#include "QueryModel.hpp"
+
+struct Result {
+    int queryID;
+    int x;
+    int y;
+    float corel;
+
+    Result(int queryID, int x, int y, float corel) : queryID(queryID), x(x), y(y), corel(corel) {
+    };
+
+    bool operator<(const Result& r) const {
+        return queryID < r.queryID;
+    }
+};
+
+typedef tbb::concurrent_vector<Result> Candidates;
+
+/*
+ * Storage of the padded scene the cascade samples: float, or 16- or 8-bit fixed
+ * point for a half or a quarter of the footprint. Sums are taken in int and the
+ * descriptors come out in the same [0, 1] range either way.
+ */
+enum ScenePixels {
+    FLOAT_PIXELS, U16_PIXELS, U8_PIXELS
+};
+
+/*
+ * Memory layout of that copy: row-major (PaddedImage) or square tiles (TiledImage).
+ */
+enum SceneLayout {
+    ROW_LAYOUT, TILED_LAYOUT
+};
+
+/*
+ * Runs the cascade for the centers in rows [firstRow, lastRow) of gray, which may
+ * be a strip of a larger scene starting at scene row yOffset. Hits are added to
+ * candidates in scene coordinates.
+ */
+void scanScene(const Image& gray, const QueryModel& model, int firstRow, int lastRow, int yOffset, Candidates& candidates,
+        ScenePixels pixels = FLOAT_PIXELS, SceneLayout layout = ROW_LAYOUT);
+
+/*
+ * Keeps one hit per group of overlapping candidates, sorted by query scale.
+ */
+std::vector<Result> mergeResults(const Candidates& candidates, const QueryModel& model);
+
+/*
+ * Runs the circle -> radian -> template cascade over every pixel of the prepared
+ * scene and merges overlapping hits. queryID of a result is the index of the
+ * matching query scale in the model.
+ */
+std::vector<Result> matchScene(const Image& gray, const QueryModel& model, ScenePixels pixels = FLOAT_PIXELS, SceneLayout layout = ROW_LAYOUT);
+
+/*
+ * Prints one "query x y" line per result in original scene coordinates,
+ * prefixed with tag and a tab unless tag is empty.
+ */
+void writeResults(std::ostream& out, const std::vector<Result>& results, const QueryModel& model, float ratio, const std::string& tag);
+
+#endif	/* MATCHER_HPP */
+
@@ -0,0 +1,70 @@
+/*
+ * File:   QueryModel.hpp
+ * Author: stasstels
+ *
+ * Created on December 5, 2013, 10:40 PM
+ */
+
+#ifndef QUERYMODEL_HPP
+#define	QUERYMODEL_HPP
+
+#include <string>
+#include <vector>
+
+#include "Core.hpp"
+
+struct ImageSize {
+    int width;
+    int height;
+
+    ImageSize() : width(0), height(0) {
+    }
+
+    ImageSize(const Image& image) : width(image.width()), height(image.height()) {
+    }
+
+    ImageSize(const RotatedGrid& grid) : width(grid.width), height(grid.height) {
+    }
+};
+
+/*
+ * Everything the scan needs to know about the queries. Scales of all queries are
+ * stored one after another, SCALES_NUMBER per query; the images themselves are
+ * dropped once their features and descriptors are taken, only sizes are kept.
+ */
+struct QueryModel {
+    std::vector<ImageSize> scaleSizes;
+    std::vector<std::vector<ImageSize> > rotationSizes;
+
+    FeaturesVector circleSet;
+    FeaturesVector radianSet;
+    FeaturesVector pointSet;
+
+    Descriptors circleDescriptors;
+    std::vector<Descriptors> radianDescriptors;
+    std::vector<Descriptors> templateDescriptors;
+};
+
+QueryModel buildQueryModel(const std::vector<std::string>& queries, float minScale, float maxScale);
+
+/*
+ * Farthest any filter of the model reaches from its center, in pixels.
+ */
+int getModelRadius(const QueryModel& model);
+
+/*
+ * Content hash of the query files, the scale range and the Core.hpp parameters
+ * the model depends on. Returns 0 if a query file cannot be read.
+ */
+unsigned long long queryModelKey(const std::vector<std::string>& queries, float minScale, float maxScale);
+
+/*
+ * Versioned binary model cache. loadQueryModel() reads the file with plain
+ * fread() calls and returns false unless it exists, is complete and was written
+ * for the same key.
+ */
+bool loadQueryModel(const std::string& filename, unsigned long long key, QueryModel& model);
+bool saveQueryModel(const std::string& filename, unsigned long long key, const QueryModel& model);
+
+#endif	/* QUERYMODEL_HPP */
+
@@ -0,0 +1,77 @@
+/*
+ * File:   RingMaps.hpp
+ * Author: stasstels
+ *
+ * Created on December 15, 2013, 4:20 PM
+ */
+
+#ifndef RINGMAPS_HPP
+#define	RINGMAPS_HPP
+
+#include <memory>
+#include <vector>
+
+#include "Core.hpp"
+
+/*
+ * Ring sums for every center of a band of scene rows at once: a ring sum is the
+ * correlation of the scene (zero outside) with the ring kernel, so one real FFT
+ * of the band and two per ring give the whole map. Rings not marked in fft get
+ * no map and are left to direct sampling. Each scene pixel is taken as
+ * pixel(value), the value the direct kernels see (storedValue()), so both paths
+ * sum the same precision.
+ *
+ * The maps and transform buffers are sized once for bands of up to bandRows
+ * rows; cover() refills them for the next band. The maps come from
+ * HugePageAllocator and are written through the band's rows like the scene, so
+ * a map row sits with the worker that reads it.
+ */
+class RingMaps {
+public:
+    RingMaps(const Image& scene, const Features& rings, const std::vector<bool>& fft, int bandRows, float (*pixel)(float));
+    ~RingMaps();
+
+    /*
+     * Maps the rows of one band of bands, which are at most bandRows.
+     */
+    void cover(RowBands& bands, int band);
+
+    bool has(int ring) const {
+        return !maps[ring].empty();
+    }
+
+    float sum(int ring, const Point& center) const {
+        return maps[ring][static_cast<size_t> (center.y - firstRow) * width + center.x];
+    }
+
+private:
+    RingMaps(const RingMaps&);
+    RingMaps& operator=(const RingMaps&);
+
+    class Transform;
+
+    const Image& scene;
+    const Features& rings;
+    float (*pixel)(float);
+    int width;
+    int firstRow;
+    int reach;
+    std::unique_ptr<Transform> transform;
+    std::vector<std::vector<float, HugePageAllocator<float> > > maps;
+};
+
+/*
+ * Ring paths for a width x rows region: AYC_RING_FFT=always maps every ring,
+ * auto times one DFTI band transform and the direct kernel at this size and maps
+ * the rings whose direct sums would take longer in bands of ringBandRows()
+ * rows, and anything else (the default) samples them all directly.
+ */
+std::vector<bool> chooseRingPaths(const Features& rings, int width, int rows);
+
+/*
+ * Rows per band, up to rows, for which the maps of the rings marked in fft fit
+ * in RING_MAP_FLOATS.
+ */
+int ringBandRows(const std::vector<bool>& fft, int width, int rows);
+
+#endif	/* RINGMAPS_HPP */
@@ -0,0 +1,36 @@
+/*
+ * File:   Server.hpp
+ * Author: stasstels
+ *
+ * Created on December 7, 2013, 6:05 PM
+ */
+
+#ifndef SERVER_HPP
+#define	SERVER_HPP
+
+#include <functional>
+#include <string>
+
+/*
+ * Line protocol over a Unix domain socket: every request is one line holding a
+ * scene path, every reply is zero or more result lines followed by an empty line.
+ * A connection may carry any number of requests; connections are served one after
+ * another, each request using the whole task scheduler.
+ */
+typedef std::function<std::string(const std::string&)> RequestHandler;
+
+/*
+ * Listens on path (replacing a stale socket, never another kind of file) until
+ * the process is killed.
+ * Returns non-zero only if the socket cannot be set up.
+ */
+int serve(const std::string& path, const RequestHandler& handler);
+
+/*
+ * Sends the same scene requests times over one connection, prints the first reply
+ * to stdout and latency figures to stderr.
+ */
+int runClient(const std::string& path, const std::string& scene, int requests);
+
+#endif	/* SERVER_HPP */
+
@@ -2,6 +2,8 @@
 #include <cmath>
 
 #include <iostream>
+#include <map>
+#include <set>
 #include <boost/range/numeric.hpp>
 #include <boost/range/adaptor/transformed.hpp>
 #include <boost/bind.hpp>
@@ -9,24 +11,409 @@
 #include <mkl_cblas.h>
 
 
+namespace {
+    /*
+     * 0.299, 0.587 and 0.114 in 14-bit fixed point. A weighted sum of 8-bit
+     * channels stays exact in an int, and a single multiply turns it into [0, 1].
+     */
+    const int R = 4899;
+    const int G = 9617;
+    const int B = 1868;
+    const float GRAY_SCALE = 1.0f / (255 * (R + G + B));
+    const float CHANNEL_SCALE = 1.0f / 255;
+
+    /*
+     * Plain unit-stride loops without aliasing between input and output, so the
+     * compiler vectorizes them for whatever target (SSE, AVX2, MIC) it builds for.
+     */
+    void convertPlanarRow2Gray(const u_char* __restrict r, const u_char* __restrict g, const u_char* __restrict b, int width, float* __restrict gray) {
+        for (int x = 0; x < width; ++x) {
+            gray[x] = (r[x] * R + g[x] * G + b[x] * B) * GRAY_SCALE;
+        }
+    }
+
+    // The channel count is a constant so the strided loads become fixed shuffles.
+    template<int CHANNELS>
+    void convertInterleavedRow2Gray(const u_char* __restrict pixels, int width, float* __restrict gray) {
+        for (int x = 0; x < width; ++x) {
+            gray[x] = (pixels[x * CHANNELS] * R + pixels[x * CHANNELS + 1] * G + pixels[x * CHANNELS + 2] * B) * GRAY_SCALE;
+        }
+    }
+
+    void convertChannel2Gray(const u_char* __restrict pixels, int width, int channels, float* __restrict gray) {
+        for (int x = 0; x < width; ++x) {
+            gray[x] = pixels[x * channels] * CHANNEL_SCALE;
+        }
+    }
+
+    // Columns filtered side by side: one AVX-512 or two AVX registers of floats.
+    const int BLUR_LANES = 16;
+
+    /*
+     * Coefficients of CImg::deriche() for order 0 with Neumann boundaries.
+     */
+    struct DericheFilter {
+        float a0, a1, a2, a3, b1, b2, coefp, coefn;
+
+        DericheFilter(float sigma) {
+            float alpha = 1.695f / sigma;
+            float ema = std::exp(-alpha);
+            float ema2 = std::exp(-2 * alpha);
+            float k = (1 - ema) * (1 - ema) / (1 + 2 * alpha * ema - ema2);
+            b1 = -2 * ema;
+            b2 = ema2;
+            a0 = k;
+            a1 = k * (alpha - 1) * ema;
+            a2 = k * (alpha + 1) * ema;
+            a3 = -k * ema2;
+            coefp = (a0 + a1) / (1 + b1 + b2);
+            coefn = (a2 + a3) / (1 + b1 + b2);
+        }
+    };
+
+    /*
+     * Filters LANES adjacent columns of length rows, stride floats apart, in place.
+     * The causal pass goes to the rows * LANES buffer and the anticausal pass adds
+     * to it, with the arithmetic of CImg's per-column loop.
+     */
+    template<int LANES>
+    void filterLanes(const DericheFilter& f, float* data, int stride, int rows, float* __restrict causal) {
+        float xp[LANES], yp[LANES], yb[LANES];
+        for (int k = 0; k < LANES; ++k) {
+            xp[k] = data[k];
+            yb[k] = yp[k] = f.coefp * xp[k];
+        }
+        for (int m = 0; m < rows; ++m) {
+            const float* row = data + static_cast<long> (m) * stride;
+            float* out = causal + m * LANES;
+            for (int k = 0; k < LANES; ++k) {
+                float xc = row[k];
+                float yc = out[k] = f.a0 * xc + f.a1 * xp[k] - f.b1 * yp[k] - f.b2 * yb[k];
+                xp[k] = xc;
+                yb[k] = yp[k];
+                yp[k] = yc;
+            }
+        }
+        float xn[LANES], xa[LANES], yn[LANES], ya[LANES];
+        const float* last = data + static_cast<long> (rows - 1) * stride;
+        for (int k = 0; k < LANES; ++k) {
+            xn[k] = xa[k] = last[k];
+            yn[k] = ya[k] = f.coefn * xn[k];
+        }
+        for (int m = rows - 1; m >= 0; --m) {
+            float* row = data + static_cast<long> (m) * stride;
+            const float* in = causal + m * LANES;
+            for (int k = 0; k < LANES; ++k) {
+                float xc = row[k];
+                float yc = f.a2 * xn[k] + f.a3 * xa[k] - f.b1 * yn[k] - f.b2 * ya[k];
+                xa[k] = xn[k];
+                xn[k] = xc;
+                ya[k] = yn[k];
+                yn[k] = yc;
+                row[k] = in[k] + yc;
+            }
+        }
+    }
+
+    /*
+     * Along x, rows [top, bottom) of one block: a full block of BLUR_LANES rows is
+     * transposed into block, filtered as columns and written back; a shorter one
+     * is filtered a row at a time. block and causal hold width * BLUR_LANES floats.
+     */
+    void filterRowBlock(const DericheFilter& f, Image& image, int top, int bottom, float* block, float* causal) {
+        int width = image.width();
+        if (bottom - top < BLUR_LANES) {
+            for (int y = top; y < bottom; ++y) {
+                filterLanes<1>(f, image.data(0, y), 1, width, causal);
+            }
+            return;
+        }
+        for (int k = 0; k < BLUR_LANES; ++k) {
+            const float* row = image.data(0, top + k);
+            for (int x = 0; x < width; ++x) {
+                block[x * BLUR_LANES + k] = row[x];
+            }
+        }
+        filterLanes<BLUR_LANES>(f, block, BLUR_LANES, width, causal);
+        for (int k = 0; k < BLUR_LANES; ++k) {
+            float* row = image.data(0, top + k);
+            for (int x = 0; x < width; ++x) {
+                row[x] = block[x * BLUR_LANES + k];
+            }
+        }
+    }
+
+    /*
+     * Runs rowBlock(top, bottom, block, causal) for blocks of BLUR_LANES rows of
+     * [first, last) in parallel, with scratch buffers for filterRowBlock().
+     */
+    template<class RowBlock>
+    void forEachRowBlock(int width, int first, int last, const RowBlock& rowBlock) {
+        int blocks = (last - first + BLUR_LANES - 1) / BLUR_LANES;
+        tbb::parallel_for(tbb::blocked_range<int>(0, blocks), [&](const tbb::blocked_range<int>& range) {
+            std::vector<float> block(width * BLUR_LANES);
+            std::vector<float> causal(width * BLUR_LANES);
+            for (int b = range.begin(); b != range.end(); ++b) {
+                int top = first + b * BLUR_LANES;
+                rowBlock(top, std::min(top + BLUR_LANES, last), block.data(), causal.data());
+            }
+        });
+    }
+
+    /*
+     * Along y: blocks of BLUR_LANES columns are filtered where they are, reading
+     * one contiguous run of each row per step; leftover columns one lane wide.
+     */
+    void filterColumns(const DericheFilter& f, Image& image) {
+        int width = image.width();
+        int height = image.height();
+        int blocks = (width + BLUR_LANES - 1) / BLUR_LANES;
+        tbb::parallel_for(tbb::blocked_range<int>(0, blocks), [&](const tbb::blocked_range<int>& range) {
+            std::vector<float> causal(height * BLUR_LANES);
+            for (int b = range.begin(); b != range.end(); ++b) {
+                int left = b * BLUR_LANES;
+                if (left + BLUR_LANES > width) {
+                    for (int x = left; x < width; ++x) {
+                        filterLanes<1>(f, image.data(x, 0), width, height, causal.data());
+                    }
+                    continue;
+                }
+                filterLanes<BLUR_LANES>(f, image.data(left, 0), width, height, causal.data());
+            }
+        });
+    }
+
+}
+
 void convert2Gray(const CImg<u_char>& colorImage, Image& grayImage) {
-    static const float R = 0.299f;
-    static const float G = 0.587f;
-    static const float B = 0.114f;
+    int width = colorImage.width();
+    tbb::parallel_for(0, colorImage.height(), [&](int y) {
+        if (colorImage.spectrum() < 3) {
+            convertChannel2Gray(colorImage.data(0, y), width, 1, grayImage.data(0, y));
+        } else {
+            convertPlanarRow2Gray(colorImage.data(0, y, 0, 0), colorImage.data(0, y, 0, 1), colorImage.data(0, y, 0, 2), width, grayImage.data(0, y));
+        }
+    });
+}
+
+void convertRow2Gray(const u_char* pixels, int width, int channels, float* gray) {
+    if (channels < 3) {
+        convertChannel2Gray(pixels, width, channels, gray);
+    } else if (channels == 3) {
+        convertInterleavedRow2Gray<3>(pixels, width, gray);
+    } else {
+        convertInterleavedRow2Gray<4>(pixels, width, gray);
+    }
+}
 
-    cimg_forXY(colorImage, x, y) {
-        grayImage(x, y) = ((colorImage(x, y, 0, 1) * R) + (colorImage(x, y, 0, 1) * G) + (colorImage(x, y, 0, 2) * B)) / 255;
+ResampleAxis::ResampleAxis(int source, int target) : first(target), offset(target + 1) {
+    double scale = static_cast<double> (source) / target;
+    for (int i = 0; i < target; ++i) {
+        double begin = i * scale;
+        double end = std::min((i + 1) * scale, static_cast<double> (source));
+        first[i] = std::min(static_cast<int> (begin), source - 1);
+        offset[i] = weights.size();
+        for (int j = first[i]; j < end; ++j) {
+            weights.push_back((std::min(end, j + 1.0) - std::max(begin, static_cast<double> (j))) / (end - begin));
+        }
     }
+    offset[target] = weights.size();
 }
 
-float getMaxRadius(const Features& f) {
-    float r = f.back().size() / (2 * PI);
-    r += (2 * r / f.size());
-    return r;
+void resampleRow(const ResampleAxis& axis, const float* source, float* target) {
+    for (int i = 0; i < axis.size(); ++i) {
+        const float* pixels = source + axis.first[i];
+        const float* weights = axis.weights.data() + axis.offset[i];
+        int count = axis.offset[i + 1] - axis.offset[i];
+        float sum = 0;
+        for (int k = 0; k < count; ++k) {
+            sum += pixels[k] * weights[k];
+        }
+        target[i] = sum;
+    }
 }
 
-bool isFitImage(float rad, const Image& i, const Point& c) {
-    return (c.x > rad) && (c.x + rad < i.width()) && (c.y > rad) && (c.y + rad < i.height());
+void accumulateRow(const float* __restrict source, float weight, int width, float* __restrict target) {
+    for (int x = 0; x < width; ++x) {
+        target[x] += source[x] * weight;
+    }
+}
+
+Image areaResize(const Image& image, int width, int height) {
+    if (width == image.width() && height == image.height()) {
+        return image;
+    }
+    ResampleAxis columns(image.width(), width);
+    ResampleAxis rows(image.height(), height);
+    Image narrow(width, image.height(), 1, 1);
+    tbb::parallel_for(0, image.height(), [&](int y) {
+        resampleRow(columns, image.data(0, y), narrow.data(0, y));
+    });
+    Image resized(width, height, 1, 1, 0);
+    tbb::parallel_for(0, height, [&](int y) {
+        for (int k = rows.offset[y]; k < rows.offset[y + 1]; ++k) {
+            accumulateRow(narrow.data(0, rows.first[y] + k - rows.offset[y]), rows.weights[k], width, resized.data(0, y));
+        }
+    });
+    return resized;
+}
+
+std::vector<Image> halvingPyramid(const Image& image, int width, int height) {
+    std::vector<Image> levels;
+    const Image* finer = &image;
+    while (finer->width() / 2 >= width && finer->height() / 2 >= height) {
+        levels.push_back(areaResize(*finer, finer->width() / 2, finer->height() / 2));
+        finer = &levels.back();
+    }
+    return levels;
+}
+
+void blurRows(Image& image, int first, int last, float sigma) {
+    if (image.width() < 2 || sigma < 0.1f) {
+        return;
+    }
+    DericheFilter filter(sigma);
+    forEachRowBlock(image.width(), first, last, [&](int top, int bottom, float* block, float* causal) {
+        filterRowBlock(filter, image, top, bottom, block, causal);
+    });
+}
+
+void blurColumns(Image& image, float sigma) {
+    if (image.height() < 2 || sigma < 0.1f) {
+        return;
+    }
+    filterColumns(DericheFilter(sigma), image);
+}
+
+void recursiveBlur(Image& image, float sigma) {
+    blurRows(image, 0, image.height(), sigma);
+    blurColumns(image, sigma);
+}
+
+Image areaResizeBlur(const Image& image, int width, int height, float sigma) {
+    if (width == image.width() && height == image.height()) {
+        Image blurred = image;
+        recursiveBlur(blurred, sigma);
+        return blurred;
+    }
+    ResampleAxis columns(image.width(), width);
+    ResampleAxis rows(image.height(), height);
+    Image narrow(width, image.height(), 1, 1);
+    tbb::parallel_for(0, image.height(), [&](int y) {
+        resampleRow(columns, image.data(0, y), narrow.data(0, y));
+    });
+    Image resized(width, height, 1, 1, 0);
+    DericheFilter filter(std::max(sigma, 0.1f));
+    bool filtered = width > 1 && sigma >= 0.1f;
+    forEachRowBlock(width, 0, height, [&](int top, int bottom, float* block, float* causal) {
+        for (int y = top; y < bottom; ++y) {
+            for (int k = rows.offset[y]; k < rows.offset[y + 1]; ++k) {
+                accumulateRow(narrow.data(0, rows.first[y] + k - rows.offset[y]), rows.weights[k], width, resized.data(0, y));
+            }
+        }
+        if (filtered) {
+            filterRowBlock(filter, resized, top, bottom, block, causal);
+        }
+    });
+    blurColumns(resized, sigma);
+    return resized;
+}
+
+RotatedGrid::RotatedGrid(const Image& image, int angle) {
+    int wm1 = image.width() - 1;
+    int hm1 = image.height() - 1;
+    angle %= FULL_DEGREES;
+    if (angle % 90 == 0) {
+        bool swapped = angle % 180 != 0;
+        width = swapped ? image.height() : image.width();
+        height = swapped ? image.width() : image.height();
+        ca = angle == 0 ? 1 : angle == 180 ? -1 : 0;
+        sa = angle == 90 ? 1 : angle == 270 ? -1 : 0;
+        x0 = angle == 0 || angle == 90 ? 0 : wm1;
+        y0 = angle == 0 || angle == 270 ? 0 : hm1;
+        return;
+    }
+    float rad = static_cast<float> (angle * cimg::PI / 180.0);
+    ca = std::cos(rad);
+    sa = std::sin(rad);
+    float ux = std::abs(image.width() * ca), uy = std::abs(image.width() * sa);
+    float vx = std::abs(image.height() * sa), vy = std::abs(image.height() * ca);
+    float dw2 = 0.5f * (ux + vx), dh2 = 0.5f * (uy + vy);
+    width = static_cast<int> (ux + vx);
+    height = static_cast<int> (uy + vy);
+    x0 = 0.5f * image.width() - dw2 * ca - dh2 * sa;
+    y0 = 0.5f * image.height() + dw2 * sa - dh2 * ca;
+}
+
+void sampleRotatedTemplate(const Image& image, const RotatedGrid& grid, Points& points, Descriptor& values) {
+    float maxX = image.width() - 1;
+    float maxY = image.height() - 1;
+    Point c(grid.width / 2, grid.height / 2);
+    for (int y = 0; y < grid.height; ++y) {
+        for (int x = 0; x < grid.width; ++x) {
+            float sx = grid.x0 + x * grid.ca + y * grid.sa;
+            float sy = grid.y0 - x * grid.sa + y * grid.ca;
+            if (sx < 0 || sy < 0 || sx > maxX || sy > maxY) {
+                continue;
+            }
+            points.push_back(Point(x - c.x, y - c.y));
+            values.push_back(image.linear_atXY(sx, sy, 0, 0, 0));
+        }
+    }
+}
+
+OffsetTable::OffsetTable(const FeaturesVector& featureSet, int stride) {
+    boost::for_each(featureSet, [&](const Features & features) {
+        firstFeature.push_back(starts.size());
+        boost::for_each(features, [&](const Points & points) {
+            starts.push_back(offsets.size());
+            boost::for_each(points, [&](const Point & p) {
+                offsets.push_back(p.y * stride + p.x);
+            });
+        });
+    });
+    starts.push_back(offsets.size());
+}
+
+DistinctRings::DistinctRings(const FeaturesVector& circleSet) : index(circleSet.size()) {
+    auto less = [](const Points& a, const Points& b) {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](const Point& p, const Point& q) {
+            return p.y < q.y || (p.y == q.y && p.x < q.x);
+        });
+    };
+    std::map<Points, int, decltype(less)> found(less);
+    for (size_t scale = 0; scale < circleSet.size(); ++scale) {
+        boost::for_each(circleSet[scale], [&](const Points & circle) {
+            auto ring = found.insert(std::make_pair(circle, static_cast<int> (rings.size())));
+            if (ring.second) {
+                rings.push_back(circle);
+            }
+            index[scale].push_back(ring.first->second);
+        });
+    }
+}
+
+int countSlidingPoints(const Points& points) {
+    std::set<std::pair<int, int> > present;
+    boost::for_each(points, [&](const Point & p) {
+        present.insert(std::make_pair(p.y, p.x));
+    });
+    int count = 0;
+    for (const auto& p : present) {
+        count += !present.count(std::make_pair(p.first, p.second - 1));
+        count += !present.count(std::make_pair(p.first, p.second + 1));
+    }
+    return count;
+}
+
+int getFeaturesReach(const Features& features) {
+    int reach = 0;
+    boost::for_each(features, [&](const Points & points) {
+        boost::for_each(points, [&](const Point & p) {
+            reach = std::max(reach, std::max(std::abs(p.x), std::abs(p.y)));
+        });
+    });
+    return reach;
 }
 
 float point2float(const Point& p, const Point& c, const Image& i) {
@@ -68,6 +455,45 @@ float evalCorrelation(const Descriptor& x, const Descriptor& y) {
     return (beta * xMeanCorrectedSquare) / (xMeanCorrectedNorm * yMeanCorrectedNorm);
 }
 
+void evalCorrelationBlock(const Descriptor& x, const float* y, float* out) {
+    const int size = x.size();
+    float xMean = boost::accumulate(x, 0.0f) / size;
+    Descriptor xMeanCorrected(size);
+    float xMeanCorrectedSquare = 0;
+    for (int i = 0; i < size; ++i) {
+        xMeanCorrected[i] = x[i] - xMean;
+        xMeanCorrectedSquare += xMeanCorrected[i] * xMeanCorrected[i];
+    }
+
+    float yMean[SIMD_CENTERS] = {};
+    for (int i = 0; i < size; ++i) {
+        for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+            yMean[lane] += y[i * SIMD_CENTERS + lane];
+        }
+    }
+    float cross[SIMD_CENTERS] = {};
+    float yMeanCorrectedSquare[SIMD_CENTERS] = {};
+    for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+        yMean[lane] /= size;
+    }
+    for (int i = 0; i < size; ++i) {
+        for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+            float yMeanCorrected = y[i * SIMD_CENTERS + lane] - yMean[lane];
+            cross[lane] += xMeanCorrected[i] * yMeanCorrected;
+            yMeanCorrectedSquare[lane] += yMeanCorrected * yMeanCorrected;
+        }
+    }
+
+    for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+        float beta = cross[lane] / xMeanCorrectedSquare;
+        float gamma = yMean[lane] - beta * xMean;
+        float betaAbs = std::abs(beta);
+        bool accepted = betaAbs >= BETA_THRESHOLD && betaAbs <= BETA_THRESHOLD_INV && std::abs(gamma) <= GAMMA_THRESHOLD;
+        float cor = cross[lane] / std::sqrt(xMeanCorrectedSquare * yMeanCorrectedSquare[lane]);
+        out[lane] = accepted ? cor : 0.0f;
+    }
+}
+
 void generateCircle(int radius, const Point& center, Points& circle) {
     int x0 = center.x;
     int y0 = center.y;
@@ -100,6 +526,14 @@ void generateCircle(int radius, const Point& center, Points& circle) {
         circle.push_back(Point(x0 + y, y0 - x));
         circle.push_back(Point(x0 - y, y0 - x));
     }
+    // The octants meet on the diagonals, where the points above come in pairs.
+    // Row order also walks the scene row by row when the circle is sampled.
+    boost::sort(circle, [](const Point& a, const Point& b) {
+        return a.y < b.y || (a.y == b.y && a.x < b.x);
+    });
+    circle.erase(std::unique(circle.begin(), circle.end(), [](const Point& a, const Point& b) {
+        return a.x == b.x && a.y == b.y;
+    }), circle.end());
 }
 
 void generateRadianLine(int angle, int radius, const Point& center, Points& radianLine) {
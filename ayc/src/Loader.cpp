@@ -0,0 +1,575 @@
+#include "Loader.hpp"
+#include "Log.hpp"
+#include "MappedFile.hpp"
+
+#include <cctype>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#ifndef AYC_NO_CODECS
+#include <jpeglib.h>
+#include <png.h>
+#endif
+
+#include <tbb/task_group.h>
+
+namespace {
+
+#ifndef AYC_NO_CODECS
+    const u_char JPEG_SIGNATURE[] = {0xFF, 0xD8, 0xFF};
+#endif
+    const int PNG_SIGNATURE_SIZE = 8;
+    const int BAND_ROWS = 16;
+    // Rows the scene sink x-filters at once: whole blocks of the row blur, never a ragged tail.
+    const int BLUR_BAND_ROWS = 16;
+    const int MAX_DECODE_REDUCTION = 8;
+    const int PNM_MAX_DIMENSION = 1 << 20;
+    const size_t BMP_HEADER_SIZE = 54;
+    // BITMAPINFOHEADER and its extensions; the 12-byte BITMAPCOREHEADER lays its fields out differently.
+    const int BMP_INFO_HEADER_SIZE = 40;
+    // Rows beyond which the recursive blur of a strip no longer differs from that of the whole scene.
+    const int STRIP_BLUR_MARGIN = 8;
+
+    /*
+     * Receives decoded 8-bit rows band by band, top to bottom. rows() is never
+     * called concurrently with itself, but runs while the next band is decoded.
+     */
+    class RowSink {
+    public:
+
+        virtual ~RowSink() {
+        }
+
+        /*
+         * Told the full size of the picture before decoding starts; returns the
+         * power-of-two reduction (1, 2, 4 or 8) the decoder may apply for free.
+         */
+        virtual int reduction(int width, int height) {
+            return 1;
+        }
+
+        virtual void begin(int width, int height) = 0;
+        virtual void rows(int y, int count, const u_char* pixels, int channels) = 0;
+    };
+
+    class GrayImageSink : public RowSink {
+    public:
+
+        GrayImageSink(Image& gray) : gray(gray) {
+        }
+
+        void begin(int width, int height) {
+            gray.assign(width, height, 1, 1);
+        }
+
+        void rows(int y, int count, const u_char* pixels, int channels) {
+            size_t rowSize = gray.width() * channels;
+            tbb::parallel_for(0, count, [&](int i) {
+                convertRow2Gray(pixels + i * rowSize, gray.width(), channels, gray.data(0, y + i));
+            });
+        }
+
+    private:
+        Image& gray;
+    };
+
+    /*
+     * Area-averaging downscale to the getScaleRatio() target, one source row at a
+     * time, so only the small image is ever allocated. A decoder that can shrink
+     * the picture itself (JPEG DCT scaling) is asked to land as close to the target
+     * as it can without going under it. Finished rows are blurred along x in bands
+     * while the decoder works on the next one; finish() completes the blur.
+     */
+    class DownscaleSink : public RowSink {
+    public:
+
+        DownscaleSink(Image& scene, float& ratio) : scene(scene), ratio(ratio), nextRow(0), blurred(0) {
+        }
+
+        int reduction(int width, int height) {
+            target(width, height);
+            int denominator = MAX_DECODE_REDUCTION;
+            while (denominator > 1 && ((width + denominator - 1) / denominator < scene.width() ||
+                    (height + denominator - 1) / denominator < scene.height())) {
+                denominator /= 2;
+            }
+            return denominator;
+        }
+
+        void begin(int width, int height) {
+            if (scene.is_empty()) {
+                target(width, height);
+            }
+            unscaled = width == scene.width() && height == scene.height();
+            scene.fill(0);
+            columns.reset(new ResampleAxis(width, scene.width()));
+            rowsAxis.reset(new ResampleAxis(height, scene.height()));
+            gray.resize(width);
+            narrow.resize(scene.width());
+        }
+
+        void rows(int y, int count, const u_char* pixels, int channels) {
+            int width = gray.size();
+            for (int i = 0; i < count; ++i, pixels += width * channels) {
+                int source = y + i;
+                if (unscaled) {
+                    convertRow2Gray(pixels, width, channels, scene.data(0, source));
+                    nextRow = source + 1;
+                    continue;
+                }
+                convertRow2Gray(pixels, width, channels, gray.data());
+                resampleRow(*columns, gray.data(), narrow.data());
+                while (nextRow < scene.height() && lastSource(nextRow) < source) {
+                    ++nextRow;
+                }
+                for (int row = nextRow; row < scene.height() && rowsAxis->first[row] <= source; ++row) {
+                    float weight = rowsAxis->weights[rowsAxis->offset[row] + source - rowsAxis->first[row]];
+                    accumulateRow(narrow.data(), weight, scene.width(), scene.data(0, row));
+                }
+            }
+            int ready = blurred + (nextRow - blurred) / BLUR_BAND_ROWS * BLUR_BAND_ROWS;
+            if (ready > blurred) {
+                blurRows(scene, blurred, ready, BLUR);
+                blurred = ready;
+            }
+        }
+
+        void finish() {
+            blurRows(scene, blurred, scene.height(), BLUR);
+            blurColumns(scene, BLUR);
+        }
+
+    private:
+
+        void target(int width, int height) {
+            ratio = getScaleRatio(width, height);
+            int scaleRatio = std::floor(ratio * 100);
+            scene.assign(scaledSize(width, scaleRatio), scaledSize(height, scaleRatio), 1, 1);
+        }
+
+        int lastSource(int row) const {
+            return rowsAxis->first[row] + rowsAxis->offset[row + 1] - rowsAxis->offset[row] - 1;
+        }
+
+        Image& scene;
+        float& ratio;
+        // Rows below nextRow have all their source rows, rows below blurred are x-filtered.
+        int nextRow;
+        int blurred;
+        bool unscaled;
+        std::unique_ptr<ResampleAxis> columns;
+        std::unique_ptr<ResampleAxis> rowsAxis;
+        std::vector<float> gray;
+        std::vector<float> narrow;
+    };
+
+    /*
+     * Keeps a sliding window of gray rows and hands out blurred, overlapping
+     * horizontal strips: stripRows rows of centers plus halo rows on either side,
+     * so only stripRows + 2 * halo rows are ever held at full resolution.
+     */
+    class StripSink : public RowSink {
+    public:
+
+        StripSink(int stripRows, int halo, const StripScanner& scan) : stripRows(stripRows), halo(halo), scan(scan) {
+        }
+
+        void begin(int width, int height) {
+            this->height = height;
+            window.assign(width, std::min(stripRows + 2 * halo, height), 1, 1);
+            top = 0;
+            filled = 0;
+            firstRow = 0;
+        }
+
+        void rows(int y, int count, const u_char* pixels, int channels) {
+            for (int i = 0; i < count; ++i, pixels += window.width() * channels) {
+                convertRow2Gray(pixels, window.width(), channels, row(y + i));
+                added();
+            }
+        }
+
+        float* row(int y) {
+            return window.data(0, y - top);
+        }
+
+        void added() {
+            ++filled;
+            // The last rows of the scene can complete more than one strip.
+            for (int lastRow = std::min(firstRow + stripRows, height); firstRow < height &&
+                    top + filled >= std::min(lastRow + halo, height); lastRow = std::min(firstRow + stripRows, height)) {
+                Image strip = window.get_rows(0, filled - 1);
+                recursiveBlur(strip, BLUR);
+                scan(strip, top, firstRow, lastRow);
+                int nextTop = std::max(lastRow - halo, 0);
+                filled -= nextTop - top;
+                std::memmove(window.data(), window.data(0, nextTop - top), sizeof (float) * window.width() * filled);
+                top = nextTop;
+                firstRow = lastRow;
+            }
+        }
+
+    private:
+        int stripRows;
+        int halo;
+        const StripScanner& scan;
+        int height;
+        Image window;
+        int top;
+        int filled;
+        int firstRow;
+    };
+
+#ifndef AYC_NO_CODECS
+
+    /*
+     * Double-buffered bands: while the sink converts one band on a TBB task, the
+     * decoder fills the other one.
+     */
+    class BandPipeline {
+    public:
+
+        BandPipeline(RowSink& sink) : sink(sink), current(0) {
+        }
+
+        ~BandPipeline() {
+            finish();
+        }
+
+        void begin(int width, int height, int channels) {
+            this->channels = channels;
+            rowSize = width * channels;
+            for (auto& band : bands) {
+                band.resize(rowSize * BAND_ROWS);
+            }
+            sink.begin(width, height);
+        }
+
+        u_char* row(int i) {
+            return bands[current].data() + i * rowSize;
+        }
+
+        void submit(int y, int count) {
+            group.wait();
+            const u_char* pixels = bands[current].data();
+            group.run([ = ]{
+                sink.rows(y, count, pixels, channels);
+            });
+            current ^= 1;
+        }
+
+        void finish() {
+            group.wait();
+        }
+
+    private:
+        RowSink& sink;
+        std::vector<u_char> bands[2];
+        int current;
+        int channels;
+        int rowSize;
+        tbb::task_group group;
+    };
+
+    struct JpegError {
+        jpeg_error_mgr manager;
+        std::jmp_buf jump;
+    };
+
+    void onJpegError(j_common_ptr info) {
+        std::longjmp(reinterpret_cast<JpegError*> (info->err)->jump, 1);
+    }
+
+    void onJpegMessage(j_common_ptr) {
+    }
+
+    bool readJpeg(std::FILE* file, RowSink& sink) {
+        jpeg_decompress_struct info;
+        JpegError error;
+        BandPipeline pipeline(sink);
+        info.err = jpeg_std_error(&error.manager);
+        error.manager.error_exit = onJpegError;
+        error.manager.output_message = onJpegMessage;
+        if (setjmp(error.jump)) {
+            pipeline.finish();
+            jpeg_destroy_decompress(&info);
+            return false;
+        }
+        jpeg_create_decompress(&info);
+        jpeg_stdio_src(&info, file);
+        jpeg_read_header(&info, TRUE);
+        if (info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK) {
+            jpeg_destroy_decompress(&info);
+            return false;
+        }
+        if (info.num_components != 1) {
+            info.out_color_space = JCS_RGB;
+        }
+        info.scale_num = 1;
+        info.scale_denom = sink.reduction(info.image_width, info.image_height);
+        if (info.scale_denom > 1) {
+            info.dct_method = JDCT_IFAST;
+        }
+        jpeg_start_decompress(&info);
+
+        pipeline.begin(info.output_width, info.output_height, info.output_components);
+        while (info.output_scanline < info.output_height) {
+            int y = info.output_scanline;
+            int count = 0;
+            while (count < BAND_ROWS && info.output_scanline < info.output_height) {
+                JSAMPROW rowPointer = pipeline.row(count);
+                count += jpeg_read_scanlines(&info, &rowPointer, 1);
+            }
+            pipeline.submit(y, count);
+        }
+        pipeline.finish();
+        jpeg_finish_decompress(&info);
+        jpeg_destroy_decompress(&info);
+        return true;
+    }
+
+    bool readPng(std::FILE* file, RowSink& sink) {
+        png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+        if (!png) {
+            return false;
+        }
+        png_infop info = png_create_info_struct(png);
+        BandPipeline pipeline(sink);
+        std::vector<u_char> image;
+        if (!info || setjmp(png_jmpbuf(png))) {
+            pipeline.finish();
+            png_destroy_read_struct(&png, &info, 0);
+            return false;
+        }
+        png_init_io(png, file);
+        png_read_info(png, info);
+
+        png_set_strip_16(png);
+        png_set_strip_alpha(png);
+        png_set_packing(png);
+        png_set_palette_to_rgb(png);
+        png_set_expand_gray_1_2_4_to_8(png);
+        int passes = png_set_interlace_handling(png);
+        png_read_update_info(png, info);
+
+        int width = png_get_image_width(png, info);
+        int height = png_get_image_height(png, info);
+        int channels = png_get_channels(png, info);
+        int rowSize = width * channels;
+        pipeline.begin(width, height, channels);
+
+        if (passes > 1) {
+            // Interlaced images are refined over several passes, so every row has to stay around until the last one.
+            image.resize(rowSize * height);
+            for (int pass = 0; pass < passes; ++pass) {
+                for (int y = 0; y < height; ++y) {
+                    png_read_row(png, image.data() + y * rowSize, 0);
+                }
+            }
+        }
+        for (int y = 0; y < height; y += BAND_ROWS) {
+            int count = std::min(BAND_ROWS, height - y);
+            for (int i = 0; i < count; ++i) {
+                if (passes > 1) {
+                    std::memcpy(pipeline.row(i), image.data() + (y + i) * rowSize, rowSize);
+                } else {
+                    png_read_row(png, pipeline.row(i), 0);
+                }
+            }
+            pipeline.submit(y, count);
+        }
+        pipeline.finish();
+        png_read_end(png, 0);
+        png_destroy_read_struct(&png, &info, 0);
+        return true;
+    }
+
+#endif
+
+    bool readPnmNumber(const MappedFile& map, size_t& offset, int& value) {
+        while (offset < map.size && (std::isspace(map.data[offset]) || map.data[offset] == '#')) {
+            if (map.data[offset] == '#') {
+                while (offset < map.size && map.data[offset] != '\n') {
+                    ++offset;
+                }
+            } else {
+                ++offset;
+            }
+        }
+        if (offset == map.size || !std::isdigit(map.data[offset])) {
+            return false;
+        }
+        value = 0;
+        while (offset < map.size && std::isdigit(map.data[offset]) && value < PNM_MAX_DIMENSION) {
+            value = value * 10 + map.data[offset++] - '0';
+        }
+        return value > 0 && value < PNM_MAX_DIMENSION;
+    }
+
+    /*
+     * Binary 8-bit PGM (P5) and PPM (P6) rows are already packed the way
+     * convertRow2Gray() reads them, so the sink gets the mapped pixels as they are.
+     */
+    bool readPnm(int fd, RowSink& sink) {
+        MappedFile map(fd);
+        size_t offset = 2;
+        int width, height, maxValue;
+        if (!map.data || !readPnmNumber(map, offset, width) || !readPnmNumber(map, offset, height) ||
+                !readPnmNumber(map, offset, maxValue) || maxValue > 255 || offset == map.size) {
+            return false;
+        }
+        int channels = map.data[1] == '6' ? 3 : 1;
+        ++offset;
+        if ((map.size - offset) / channels / width < static_cast<size_t> (height)) {
+            return false;
+        }
+        sink.begin(width, height);
+        sink.rows(0, height, map.data + offset, channels);
+        return true;
+    }
+
+    int readLittleEndian(const u_char* bytes, int count) {
+        unsigned value = 0;
+        for (int i = count - 1; i >= 0; --i) {
+            value = (value << 8) | bytes[i];
+        }
+        return static_cast<int> (value);
+    }
+
+    /*
+     * Uncompressed 24- and 32-bit BMP. Rows are stored bottom-up (unless the height
+     * is negative) in BGR order, so each one is swapped into a single row buffer on
+     * its way to the sink.
+     */
+    bool readBmp(int fd, RowSink& sink) {
+        MappedFile map(fd);
+        if (!map.data || map.size < BMP_HEADER_SIZE) {
+            return false;
+        }
+        if (readLittleEndian(map.data + 14, 4) < BMP_INFO_HEADER_SIZE) {
+            return false;
+        }
+        size_t offset = readLittleEndian(map.data + 10, 4);
+        int width = readLittleEndian(map.data + 18, 4);
+        int height = readLittleEndian(map.data + 22, 4);
+        int bitsPerPixel = readLittleEndian(map.data + 28, 2);
+        int compression = readLittleEndian(map.data + 30, 4);
+        if (height == std::numeric_limits<int>::min()) {
+            return false;
+        }
+        bool topDown = height < 0;
+        height = std::abs(height);
+        if ((bitsPerPixel != 24 && bitsPerPixel != 32) || compression != 0 || width <= 0 || height == 0) {
+            return false;
+        }
+        int bytesPerPixel = bitsPerPixel / 8;
+        size_t stride = (static_cast<size_t> (width) * bitsPerPixel + 31) / 32 * 4;
+        if (offset > map.size || (map.size - offset) / stride < static_cast<size_t> (height)) {
+            return false;
+        }
+        std::vector<u_char> row(width * 3);
+        sink.begin(width, height);
+        for (int y = 0; y < height; ++y) {
+            const u_char* pixels = map.data + offset + (topDown ? y : height - 1 - y) * stride;
+            for (int x = 0; x < width; ++x, pixels += bytesPerPixel) {
+                row[3 * x] = pixels[2];
+                row[3 * x + 1] = pixels[1];
+                row[3 * x + 2] = pixels[0];
+            }
+            sink.rows(y, 1, row.data(), 3);
+        }
+        return true;
+    }
+
+    bool readInProcess(const char* filename, RowSink& sink) {
+        std::FILE* file = std::fopen(filename, "rb");
+        if (!file) {
+            return false;
+        }
+        u_char signature[PNG_SIGNATURE_SIZE] = {0};
+        bool read = false;
+        if (std::fread(signature, 1, PNG_SIGNATURE_SIZE, file) == PNG_SIGNATURE_SIZE) {
+            std::rewind(file);
+            if (signature[0] == 'P' && (signature[1] == '5' || signature[1] == '6')) {
+                read = readPnm(fileno(file), sink);
+            } else if (signature[0] == 'B' && signature[1] == 'M') {
+                read = readBmp(fileno(file), sink);
+            }
+#ifndef AYC_NO_CODECS
+            else if (!std::memcmp(signature, JPEG_SIGNATURE, sizeof (JPEG_SIGNATURE))) {
+                read = readJpeg(file, sink);
+            } else if (!png_sig_cmp(signature, 0, PNG_SIGNATURE_SIZE)) {
+                read = readPng(file, sink);
+            }
+#endif
+        }
+        std::fclose(file);
+        return read;
+    }
+
+    Image readGrayImageCImg(const char* filename) {
+        CImg<u_char> image(filename);
+        Image gray(image.width(), image.height(), 1, 1);
+        convert2Gray(image, gray);
+        return gray;
+    }
+}
+
+Image readGrayImage(const char* filename) {
+#ifdef AYC_TIMING
+    try {
+        Log log("CImg decode");
+        readGrayImageCImg(filename);
+    } catch (const CImgException&) {
+    }
+#endif
+    Log log("decode");
+    Image gray;
+    GrayImageSink sink(gray);
+    if (readInProcess(filename, sink)) {
+        return gray;
+    }
+    return readGrayImageCImg(filename);
+}
+
+float getScaleRatio(int width, int height) {
+    float imageSize = static_cast<float> (width) * height;
+    if (imageSize < MAX_IMAGE_SIZE) {
+        return 1.000f;
+    }
+    return 1 / std::sqrt(imageSize / MAX_IMAGE_SIZE);
+}
+
+void readSceneStrips(const char* filename, int stripRows, int halo, const StripScanner& scan) {
+    Log log("scene strips");
+    StripSink sink(stripRows, halo + STRIP_BLUR_MARGIN, scan);
+    if (!readInProcess(filename, sink)) {
+        Image gray = readGrayImageCImg(filename);
+        sink.begin(gray.width(), gray.height());
+        cimg_forY(gray, y) {
+            std::memcpy(sink.row(y), gray.data(0, y), sizeof (float) * gray.width());
+            sink.added();
+        }
+    }
+}
+
+Image readScene(const char* filename, float& ratio) {
+    Log log("scene ingest");
+    Image scene;
+    DownscaleSink sink(scene, ratio);
+    // A single returned object, so the scene is never copied on the way out.
+    if (readInProcess(filename, sink)) {
+        sink.finish();
+    } else {
+        Image gray = readGrayImageCImg(filename);
+        ratio = getScaleRatio(gray.width(), gray.height());
+        int scaleRatio = std::floor(ratio * 100);
+        areaResizeBlur(gray, scaledSize(gray.width(), scaleRatio), scaledSize(gray.height(), scaleRatio), BLUR).move_to(scene);
+    }
+    return scene;
+}
@@ -0,0 +1,323 @@
+#include "Matcher.hpp"
+#include "Log.hpp"
+#include "RingMaps.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/range/algorithm.hpp>
+#include <boost/bind.hpp>
+
+#include <tbb/parallel_for.h>
+
+namespace {
+    /*
+     * Samples the model features around a center of Scene: point by point
+     * through the scene cursor in general, ...
+     */
+    template<class Scene>
+    class ModelSampler {
+    public:
+        typedef typename Scene::Cursor Cursor;
+
+        ModelSampler(const QueryModel& model, const DistinctRings& rings, const Scene& scene) : model(model), distinct(rings), scene(scene) {
+        }
+
+        float ring(int i, const Cursor& cursor) const {
+            return evalSample(distinct.rings[i], cursor);
+        }
+
+        void ringBlock(int i, const Point& first, float* out) const {
+            for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+                out[lane] = ring(i, scene.cursor(Point(first.x + lane, first.y)));
+            }
+        }
+
+        template<class OutputIterator>
+        void radians(int scale, const Cursor& cursor, OutputIterator out) const {
+            evalSampleDescriptor(model.radianSet[scale], cursor, out);
+        }
+
+        template<class OutputIterator>
+        void points(int scale, int rotation, const Cursor& cursor, OutputIterator out) const {
+            evalPointDescriptor(model.pointSet[scale][rotation], cursor, out);
+        }
+
+    private:
+        const QueryModel& model;
+        const DistinctRings& distinct;
+        const Scene& scene;
+    };
+
+    /*
+     * ... and through the model compiled to linear offsets for its stride on a
+     * row-major scene, where a block of adjacent centers is summed in SIMD.
+     */
+    template<class Pixel>
+    class ModelSampler<PaddedImage<Pixel> > {
+    public:
+        typedef typename PaddedImage<Pixel>::Cursor Cursor;
+
+        ModelSampler(const QueryModel& model, const DistinctRings& rings, const PaddedImage<Pixel>& scene) :
+        scene(scene), ringSet(FeaturesVector(1, rings.rings), scene.stride()),
+        radianSet(model.radianSet, scene.stride()), pointSet(model.pointSet, scene.stride()) {
+        }
+
+        float ring(int i, const Cursor& cursor) const {
+            return evalSample(ringSet.begin(0, i), ringSet.end(0, i), cursor.center);
+        }
+
+        void ringBlock(int i, const Point& first, float* out) const {
+            evalSampleBlock(ringSet.begin(0, i), ringSet.end(0, i), scene.at(first), out);
+        }
+
+        template<class OutputIterator>
+        void radians(int scale, const Cursor& cursor, OutputIterator out) const {
+            for (int i = 0; i < ROTATIONS_NUMBER; ++i) {
+                *out++ = evalSample(radianSet.begin(scale, i), radianSet.end(scale, i), cursor.center);
+            }
+        }
+
+        template<class OutputIterator>
+        void points(int scale, int rotation, const Cursor& cursor, OutputIterator out) const {
+            for (const int* offset = pointSet.begin(scale, rotation); offset != pointSet.end(scale, rotation); ++offset) {
+                *out++ = cursor.center[*offset] * PixelTraits<Pixel>::scale();
+            }
+        }
+
+    private:
+        const PaddedImage<Pixel>& scene;
+        OffsetTable ringSet;
+        OffsetTable radianSet;
+        OffsetTable pointSet;
+    };
+
+    /*
+     * Centers of image whose filter of the given reach stays inside it, the old
+     * isFitImage() test: reach < x < width - reach, and the same along y. The
+     * border only keeps reads in bounds; centers outside the range are skipped,
+     * not correlated against zeros.
+     */
+    struct FitRange {
+        int left;
+        int right;
+        int top;
+        int bottom;
+
+        FitRange(int reach, const Image& image) : left(reach + 1), right(image.width() - reach), top(reach + 1), bottom(image.height() - reach) {
+        }
+
+        bool contains(const Point& center) const {
+            return center.x >= left && center.x < right && center.y >= top && center.y < bottom;
+        }
+    };
+
+    template<class Scene>
+    void scanPixels(const Image& gray, const QueryModel& model, int firstRow, int lastRow, int yOffset, Candidates& thirdGrade) {
+        auto QUERY_SCALES_NUMBER = model.scaleSizes.size();
+
+        const Descriptors& queryCircleDescriptors = model.circleDescriptors;
+        const std::vector<Descriptors>& queryRadianDescriptorVector = model.radianDescriptors;
+        const std::vector<Descriptors>& queryTemplateDescriptorVector = model.templateDescriptors;
+
+        DistinctRings distinct(model.circleSet);
+        std::vector<bool> ringPaths = chooseRingPaths(distinct.rings, gray.width(), lastRow - firstRow);
+        // One band when no ring is mapped; otherwise as many as keep the maps in budget.
+        int bandRows = ringBandRows(ringPaths, gray.width(), lastRow - firstRow);
+        RowBands bands(firstRow, lastRow, bandRows);
+        // Every filter stays within getModelRadius() of its center, so the border covers all reads.
+        Scene scene(gray, getModelRadius(model), bands);
+        ModelSampler<Scene> sampler(model, distinct, scene);
+        typedef typename Scene::Cursor Cursor;
+        RingMaps ringMaps(gray, distinct.rings, ringPaths, bandRows, storedValue<typename Cursor::PixelType>);
+
+        std::vector<FitRange> circleFit;
+        std::vector<FitRange> radianFit;
+        std::vector<std::vector<FitRange> > templateFit(QUERY_SCALES_NUMBER);
+        for (size_t q = 0; q < QUERY_SCALES_NUMBER; ++q) {
+            circleFit.push_back(FitRange(getFeaturesReach(model.circleSet[q]), gray));
+            radianFit.push_back(FitRange(getFeaturesReach(model.radianSet[q]), gray));
+            boost::for_each(model.rotationSizes[q], [&](const ImageSize & size) {
+                templateFit[q].push_back(FitRange(std::max(size.width, size.height) / 2, gray));
+            });
+        }
+
+        auto TemplateFilter = [&](const Point& center, const Cursor& cursor, int probableScale, int probableRotation) {
+            if (!templateFit[probableScale][probableRotation].contains(center)) {
+                return;
+            }
+            Descriptor templateDescriptor;
+            sampler.points(probableScale, probableRotation, cursor, std::back_inserter(templateDescriptor));
+            auto cor = evalCorrelation(templateDescriptor, queryTemplateDescriptorVector[probableScale][probableRotation]);
+            if (cor > TEMPLATE_FILTER_THRESHOLD) {
+                thirdGrade.push_back(Result(probableScale, center.x, center.y + yOffset, cor));
+            }
+        };
+
+        auto RadianFilter = [&](const Point& center, const Cursor& cursor, int probableScale) {
+            if (!radianFit[probableScale].contains(center)) {
+                return;
+            }
+            Descriptor radianDescriptor(ROTATIONS_NUMBER);
+            std::vector<float> correlations(ROTATIONS_NUMBER);
+            sampler.radians(probableScale, cursor, std::begin(radianDescriptor));
+            boost::transform(queryRadianDescriptorVector[probableScale], std::begin(correlations), boost::bind(evalCorrelation, _1, boost::cref(radianDescriptor)));
+            auto min = boost::max_element(correlations);
+            if (*min > RADIAN_FILTER_THRESHOLD) {
+                TemplateFilter(center, cursor, probableScale, min - std::begin(correlations));
+            }
+        };
+
+        auto CircleFilter = [&](const Point & center) {
+            Cursor cursor = scene.cursor(center);
+            // Each distinct ring is summed once, or looked up in its map; the scale
+            // descriptors gather from the sums.
+            std::vector<float> ringSums(distinct.rings.size());
+            for (size_t i = 0; i < ringSums.size(); ++i) {
+                ringSums[i] = ringMaps.has(i) ? ringMaps.sum(i, center) : sampler.ring(i, cursor);
+            }
+            Descriptors circleDescriptors(QUERY_SCALES_NUMBER, Descriptor(CIRCLES_NUMBER));
+            std::vector<float> correlations(QUERY_SCALES_NUMBER);
+            for (size_t q = 0; q < QUERY_SCALES_NUMBER; ++q) {
+                boost::transform(distinct.index[q], std::begin(circleDescriptors[q]), [&](int ring) {
+                    return ringSums[ring];
+                });
+            }
+            for (size_t q = 0; q < QUERY_SCALES_NUMBER; ++q) {
+                correlations[q] = circleFit[q].contains(center) ? evalCorrelation(queryCircleDescriptors[q], circleDescriptors[q]) : 0.0f;
+            }
+            auto min = boost::max_element(correlations);
+            if (*min > CIRCLE_FILTER_THRESHOLD) {
+                RadianFilter(center, cursor, min - std::begin(correlations));
+            }
+        };
+
+        // CircleFilter for SIMD_CENTERS adjacent centers of a row from first on:
+        // ring sums, descriptors and correlations are kept lane by lane, and only
+        // the lanes passing the threshold go on to the radian filter. Scales that do
+        // not fit a lane score 0 there, as in CircleFilter. Only lanes
+        // [firstLane, lastLane) are reported. ringBlocks holds SIMD_CENTERS sums per
+        // distinct ring and is the caller's, reused across blocks.
+        auto CircleFilterBlock = [&](const Point & first, int firstLane, int lastLane, float* ringBlocks) {
+            for (size_t i = 0; i < distinct.rings.size(); ++i) {
+                float* block = &ringBlocks[i * SIMD_CENTERS];
+                if (ringMaps.has(i)) {
+                    for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+                        block[lane] = ringMaps.sum(i, Point(first.x + lane, first.y));
+                    }
+                } else {
+                    sampler.ringBlock(i, first, block);
+                }
+            }
+            float descriptors[CIRCLES_NUMBER * SIMD_CENTERS];
+            float correlations[SIMD_CENTERS];
+            float best[SIMD_CENTERS];
+            int bestScale[SIMD_CENTERS] = {};
+            for (size_t q = 0; q < QUERY_SCALES_NUMBER; ++q) {
+                const FitRange& fit = circleFit[q];
+                if (first.y >= fit.top && first.y < fit.bottom && first.x + SIMD_CENTERS > fit.left && first.x < fit.right) {
+                    for (int c = 0; c < CIRCLES_NUMBER; ++c) {
+                        std::copy_n(&ringBlocks[distinct.index[q][c] * SIMD_CENTERS], SIMD_CENTERS, descriptors + c * SIMD_CENTERS);
+                    }
+                    evalCorrelationBlock(queryCircleDescriptors[q], descriptors, correlations);
+                } else {
+                    std::fill_n(correlations, SIMD_CENTERS, 0.0f);
+                }
+                for (int lane = 0; lane < SIMD_CENTERS; ++lane) {
+                    int x = first.x + lane;
+                    correlations[lane] = x >= fit.left && x < fit.right ? correlations[lane] : 0.0f;
+                    bool better = q == 0 || correlations[lane] > best[lane];
+                    best[lane] = better ? correlations[lane] : best[lane];
+                    bestScale[lane] = better ? q : bestScale[lane];
+                }
+            }
+            for (int lane = firstLane; lane < lastLane; ++lane) {
+                if (best[lane] > CIRCLE_FILTER_THRESHOLD) {
+                    Point center(first.x + lane, first.y);
+                    RadianFilter(center, scene.cursor(center), bestScale[lane]);
+                }
+            }
+        };
+
+        for (int band = 0; band < bands.count(); ++band) {
+            ringMaps.cover(bands, band);
+            bands.forBand(band, [&](const tbb::blocked_range<int>& rows) {
+                // Rows are walked in blocks of adjacent centers. The remainder is one
+                // more block moved back to end at the row's end, with its already
+                // scanned lanes masked, so every center is scored by the same block
+                // arithmetic. Only scenes narrower than a block are left to
+                // CircleFilter, all of their centers.
+                std::vector<float> ringBlocks(distinct.rings.size() * SIMD_CENTERS);
+                int end = gray.width();
+                for (int j = rows.begin(); j < rows.end(); ++j) {
+                    int i = 0;
+                    for (; i + SIMD_CENTERS <= end; i += SIMD_CENTERS) {
+                        CircleFilterBlock(Point(i, j), 0, SIMD_CENTERS, ringBlocks.data());
+                    }
+                    if (i < end && end >= SIMD_CENTERS) {
+                        CircleFilterBlock(Point(end - SIMD_CENTERS, j), i - (end - SIMD_CENTERS), SIMD_CENTERS, ringBlocks.data());
+                    } else {
+                        for (; i < end; ++i) {
+                            CircleFilter(Point(i, j));
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+    template<template<class> class Layout>
+    void scanLayout(const Image& gray, const QueryModel& model, int firstRow, int lastRow, int yOffset, Candidates& thirdGrade, ScenePixels pixels) {
+        if (pixels == U16_PIXELS) {
+            scanPixels<Layout<uint16_t> >(gray, model, firstRow, lastRow, yOffset, thirdGrade);
+        } else if (pixels == U8_PIXELS) {
+            scanPixels<Layout<uint8_t> >(gray, model, firstRow, lastRow, yOffset, thirdGrade);
+        } else {
+            scanPixels<Layout<float> >(gray, model, firstRow, lastRow, yOffset, thirdGrade);
+        }
+    }
+}
+
+void scanScene(const Image& gray, const QueryModel& model, int firstRow, int lastRow, int yOffset, Candidates& thirdGrade, ScenePixels pixels,
+        SceneLayout layout) {
+    Log log("scan");
+    if (layout == TILED_LAYOUT) {
+        scanLayout<TiledImage>(gray, model, firstRow, lastRow, yOffset, thirdGrade, pixels);
+    } else {
+        scanLayout<PaddedImage>(gray, model, firstRow, lastRow, yOffset, thirdGrade, pixels);
+    }
+}
+
+std::vector<Result> mergeResults(const Candidates& thirdGrade, const QueryModel& model) {
+    std::vector<Result> finalResult;
+    boost::for_each(thirdGrade, [&](const Result & candidate) {
+        auto f = boost::find_if(finalResult, boost::bind<bool>([&](const Result & result) {
+            return (std::abs(candidate.x - result.x) < (model.scaleSizes[candidate.queryID].width + model.scaleSizes[result.queryID].width) / 2) &&
+                    (std::abs(candidate.y - result.y) < (model.scaleSizes[candidate.queryID].height + model.scaleSizes[result.queryID].height) / 2);
+        }, _1));
+        if (f != finalResult.end() && f -> corel > candidate.corel) {
+            *f = candidate;
+        }
+        if (f == finalResult.end()) {
+            finalResult.push_back(candidate);
+        }
+    });
+    boost::sort(finalResult);
+    return finalResult;
+}
+
+std::vector<Result> matchScene(const Image& gray, const QueryModel& model, ScenePixels pixels, SceneLayout layout) {
+    Candidates thirdGrade;
+    scanScene(gray, model, 0, gray.height(), 0, thirdGrade, pixels, layout);
+    return mergeResults(thirdGrade, model);
+}
+
+void writeResults(std::ostream& out, const std::vector<Result>& results, const QueryModel& model, float ratio, const std::string& tag) {
+    auto QUERY_SCALES_NUMBER = model.scaleSizes.size();
+    boost::for_each(results, [&](const Result & r) {
+        if (!tag.empty()) {
+            out << tag << "\t";
+        }
+        out << 1 + r.queryID / QUERY_SCALES_NUMBER << "\t" << (int) std::floor(r.x / ratio) << "\t" << (int) std::floor(r.y / ratio) << std::endl;
+    });
+}
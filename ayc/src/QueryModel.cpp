@@ -0,0 +1,245 @@
+#include "QueryModel.hpp"
+#include "Loader.hpp"
+#include "Log.hpp"
+#include "MappedFile.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+    const char MODEL_MAGIC[] = {'A', 'Y', 'C', 'Q'};
+    // Bumped whenever query preprocessing changes, so stale cached models are rebuilt.
+    const unsigned MODEL_VERSION = 7;
+
+    const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+    const unsigned long long FNV_PRIME = 1099511628211ULL;
+
+    void hash(unsigned long long& h, const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*> (data);
+        for (size_t i = 0; i < size; ++i) {
+            h = (h ^ bytes[i]) * FNV_PRIME;
+        }
+    }
+
+    template<class T>
+    void hash(unsigned long long& h, const T& value) {
+        hash(h, &value, sizeof (value));
+    }
+
+    /*
+     * Every vector is stored as a 32-bit element count followed by its elements;
+     * vectors of Points or floats are a single raw block.
+     */
+    template<class T>
+    void write(std::FILE* file, const std::vector<T>& values) {
+        unsigned count = values.size();
+        std::fwrite(&count, sizeof (count), 1, file);
+        std::fwrite(values.data(), sizeof (T), count, file);
+    }
+
+    template<class T>
+    void write(std::FILE* file, const std::vector<std::vector<T> >& values) {
+        unsigned count = values.size();
+        std::fwrite(&count, sizeof (count), 1, file);
+        boost::for_each(values, [&](const std::vector<T>& v) {
+            write(file, v);
+        });
+    }
+
+    /*
+     * Reads the cache with one fread() per vector, through a block buffer reused
+     * for all of them; remaining bounds every count by what is left of the file.
+     */
+    class Reader {
+    public:
+
+        Reader(std::FILE* file, size_t size) : file(file), remaining(size) {
+        }
+
+        bool read(void* value, size_t size) {
+            if (remaining < size || std::fread(value, 1, size, file) != size) {
+                return false;
+            }
+            remaining -= size;
+            return true;
+        }
+
+        template<class T>
+        bool read(std::vector<T>& values) {
+            unsigned count;
+            if (!read(&count, sizeof (count)) || remaining / sizeof (T) < count) {
+                return false;
+            }
+            block.resize(count * sizeof (T));
+            if (!read(block.data(), block.size())) {
+                return false;
+            }
+            const T* first = reinterpret_cast<const T*> (block.data());
+            values.assign(first, first + count);
+            return true;
+        }
+
+        template<class T>
+        bool read(std::vector<std::vector<T> >& values) {
+            unsigned count;
+            if (!read(&count, sizeof (count)) || remaining < count) {
+                return false;
+            }
+            values.resize(count);
+            return boost::find_if(values, [&](std::vector<T>& v) {
+                return !read(v);
+            }) == values.end();
+        }
+
+        bool done() const {
+            return remaining == 0;
+        }
+
+    private:
+        std::FILE* file;
+        size_t remaining;
+        std::vector<unsigned char> block;
+    };
+
+    bool readModelFile(std::FILE* file, unsigned long long key, QueryModel& model) {
+        struct stat status;
+        if (fstat(fileno(file), &status) || status.st_size <= 0) {
+            return false;
+        }
+        Reader reader(file, status.st_size);
+        char magic[sizeof (MODEL_MAGIC)];
+        unsigned version;
+        unsigned long long storedKey;
+        if (!reader.read(magic, sizeof (magic)) || std::memcmp(magic, MODEL_MAGIC, sizeof (magic)) ||
+                !reader.read(&version, sizeof (version)) || version != MODEL_VERSION ||
+                !reader.read(&storedKey, sizeof (storedKey)) || storedKey != key) {
+            return false;
+        }
+        QueryModel loaded;
+        if (!reader.read(loaded.scaleSizes) || !reader.read(loaded.rotationSizes) ||
+                !reader.read(loaded.circleSet) || !reader.read(loaded.radianSet) || !reader.read(loaded.pointSet) ||
+                !reader.read(loaded.circleDescriptors) || !reader.read(loaded.radianDescriptors) ||
+                !reader.read(loaded.templateDescriptors) || !reader.done()) {
+            return false;
+        }
+        model = std::move(loaded);
+        return true;
+    }
+}
+
+QueryModel buildQueryModel(const std::vector<std::string>& queries, float minScale, float maxScale) {
+    Log log("query model");
+    QueryModel model;
+    std::vector<Image> queryScales(queries.size() * SCALES_NUMBER);
+    tbb::parallel_for(0, static_cast<int> (queries.size()), [&](int i) {
+        Image query = readGrayImage(queries[i].c_str());
+        generateScales(query, minScale, maxScale, std::begin(queryScales) + i * SCALES_NUMBER);
+    });
+    auto QUERY_SCALES_NUMBER = queryScales.size();
+
+    model.circleSet.assign(QUERY_SCALES_NUMBER, Features(CIRCLES_NUMBER));
+    model.radianSet.assign(QUERY_SCALES_NUMBER, Features(ROTATIONS_NUMBER));
+    model.pointSet.assign(QUERY_SCALES_NUMBER, Features(ROTATIONS_NUMBER));
+
+    model.circleDescriptors.assign(QUERY_SCALES_NUMBER, Descriptor(CIRCLES_NUMBER));
+    model.radianDescriptors.assign(QUERY_SCALES_NUMBER, Descriptors(ROTATIONS_NUMBER));
+    model.templateDescriptors.assign(QUERY_SCALES_NUMBER, Descriptors(ROTATIONS_NUMBER));
+    model.rotationSizes.assign(QUERY_SCALES_NUMBER, std::vector<ImageSize>(ROTATIONS_NUMBER));
+
+    generateCirclesSet(queryScales, std::begin(model.circleSet));
+    generateRadianSet(queryScales, std::begin(model.radianSet));
+    generateTemplates(queryScales, std::begin(model.rotationSizes), std::begin(model.pointSet), std::begin(model.templateDescriptors));
+
+    evalQueryDescriptors(model.circleSet, std::begin(queryScales), std::begin(model.circleDescriptors));
+    evalQueryRadianDescriptorsVector(model.radianSet, std::begin(queryScales), std::begin(model.radianDescriptors));
+
+    model.scaleSizes.assign(std::begin(queryScales), std::end(queryScales));
+    return model;
+}
+
+int getModelRadius(const QueryModel& model) {
+    int radius = 0;
+    boost::for_each(model.rotationSizes, [&](const std::vector<ImageSize>& rotations) {
+        boost::for_each(rotations, [&](const ImageSize & size) {
+            radius = std::max(radius, std::max(size.width, size.height) / 2);
+        });
+    });
+    // Radian lines and circles are measured point by point: their point counts say little about their radius.
+    for (const FeaturesVector* set : {&model.circleSet, &model.radianSet, &model.pointSet}) {
+        boost::for_each(*set, [&](const Features & features) {
+            radius = std::max(radius, getFeaturesReach(features));
+        });
+    }
+    return radius + 1;
+}
+
+unsigned long long queryModelKey(const std::vector<std::string>& queries, float minScale, float maxScale) {
+    unsigned long long h = FNV_OFFSET;
+    hash(h, MODEL_VERSION);
+    hash(h, minScale);
+    hash(h, maxScale);
+    hash(h, BLUR);
+    hash(h, SCALES_NUMBER);
+    hash(h, ROTATIONS_NUMBER);
+    hash(h, CIRCLES_NUMBER);
+    hash(h, MIN_CIRCLE_RADIUS);
+    hash(h, MAX_CIRCLE_RADIUS);
+    for (const std::string& query : queries) {
+        int fd = open(query.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+        MappedFile map(fd);
+        close(fd);
+        if (!map.data) {
+            return 0;
+        }
+        hash(h, map.size);
+        hash(h, map.data, map.size);
+    }
+    return h;
+}
+
+bool loadQueryModel(const std::string& filename, unsigned long long key, QueryModel& model) {
+    Log log("query model cache load");
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    bool loaded = readModelFile(file, key, model);
+    std::fclose(file);
+    return loaded;
+}
+
+bool saveQueryModel(const std::string& filename, unsigned long long key, const QueryModel& model) {
+    // Written aside and renamed into place, so a concurrent run never maps a half-written model.
+    std::string temporary = filename + ".tmp" + std::to_string(getpid());
+    std::FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    std::fwrite(MODEL_MAGIC, sizeof (MODEL_MAGIC), 1, file);
+    std::fwrite(&MODEL_VERSION, sizeof (MODEL_VERSION), 1, file);
+    std::fwrite(&key, sizeof (key), 1, file);
+    write(file, model.scaleSizes);
+    write(file, model.rotationSizes);
+    write(file, model.circleSet);
+    write(file, model.radianSet);
+    write(file, model.pointSet);
+    write(file, model.circleDescriptors);
+    write(file, model.radianDescriptors);
+    write(file, model.templateDescriptors);
+    bool written = !std::ferror(file);
+    written = !std::fclose(file) && written;
+    if (!written || std::rename(temporary.c_str(), filename.c_str())) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,286 @@
+#include "RingMaps.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdlib>
+#include <limits>
+#include <string>
+
+#include <mkl_dfti.h>
+#include <tbb/task_scheduler_init.h>
+
+namespace {
+    // Most map floats kept at once, 64 MB; larger scenes are mapped in bands.
+    const size_t RING_MAP_FLOATS = size_t(1) << 24;
+
+    // Fewest scene rows the direct kernel is timed on; two per hardware thread
+    // when there are more threads, so every worker gets rows.
+    const int DIRECT_SAMPLE_ROWS = 16;
+
+    /*
+     * Smallest size from size up with no prime factor above 5, the lengths DFTI
+     * handles fastest.
+     */
+    int fftSize(int size) {
+        for (int n = std::max(size, 1);; ++n) {
+            int m = n;
+            for (int p : {2, 3, 5}) {
+                while (m % p == 0) {
+                    m /= p;
+                }
+            }
+            if (m == 1) {
+                return n;
+            }
+        }
+    }
+
+    /*
+     * Out-of-place 2D real transforms of ny x nx floats to and from the
+     * ny x (nx / 2 + 1) conjugate-even half of the spectrum. The backward one is
+     * scaled, so a round trip is the identity.
+     */
+    class RealFFT {
+    public:
+
+        RealFFT(int ny, int nx) : forward(0), backward(0) {
+            MKL_LONG sizes[2] = {ny, nx};
+            MKL_LONG real[3] = {0, nx, 1};
+            MKL_LONG complex[3] = {0, nx / 2 + 1, 1};
+            ready = create(forward, sizes, real, complex, 1.0f) && create(backward, sizes, complex, real, 1.0f / nx / ny);
+        }
+
+        ~RealFFT() {
+            if (forward) {
+                DftiFreeDescriptor(&forward);
+            }
+            if (backward) {
+                DftiFreeDescriptor(&backward);
+            }
+        }
+
+        bool ready;
+
+        void toFrequency(float* space, std::complex<float>* frequency) {
+            DftiComputeForward(forward, space, frequency);
+        }
+
+        void toSpace(std::complex<float>* frequency, float* space) {
+            DftiComputeBackward(backward, frequency, space);
+        }
+
+    private:
+        RealFFT(const RealFFT&);
+        RealFFT& operator=(const RealFFT&);
+
+        static bool create(DFTI_DESCRIPTOR_HANDLE& handle, MKL_LONG* sizes, MKL_LONG* input, MKL_LONG* output, float scale) {
+            return DftiCreateDescriptor(&handle, DFTI_SINGLE, DFTI_REAL, 2, sizes) == DFTI_NO_ERROR &&
+                    DftiSetValue(handle, DFTI_PLACEMENT, DFTI_NOT_INPLACE) == DFTI_NO_ERROR &&
+                    DftiSetValue(handle, DFTI_CONJUGATE_EVEN_STORAGE, DFTI_COMPLEX_COMPLEX) == DFTI_NO_ERROR &&
+                    DftiSetValue(handle, DFTI_INPUT_STRIDES, input) == DFTI_NO_ERROR &&
+                    DftiSetValue(handle, DFTI_OUTPUT_STRIDES, output) == DFTI_NO_ERROR &&
+                    DftiSetValue(handle, DFTI_BACKWARD_SCALE, scale) == DFTI_NO_ERROR &&
+                    DftiCommitDescriptor(handle) == DFTI_NO_ERROR;
+        }
+
+        DFTI_DESCRIPTOR_HANDLE forward;
+        DFTI_DESCRIPTOR_HANDLE backward;
+    };
+
+    int getRingsReach(const Features& rings, const std::vector<bool>& selected) {
+        int reach = 0;
+        for (size_t i = 0; i < rings.size(); ++i) {
+            if (selected[i]) {
+                reach = std::max(reach, getFeaturesReach(Features(1, rings[i])));
+            }
+        }
+        return reach;
+    }
+
+    double seconds(std::chrono::steady_clock::duration elapsed) {
+        return std::chrono::duration<double>(elapsed).count();
+    }
+
+    /*
+     * Wall time cover() spends per mapped ring of an ny x nx transform: forward,
+     * spectrum product and backward, best of two runs after a warm-up one. Below
+     * zero if DFTI cannot set that size up.
+     */
+    double timeRingTransform(int ny, int nx) {
+        RealFFT fft(ny, nx);
+        if (!fft.ready) {
+            return -1;
+        }
+        std::vector<float> space(static_cast<size_t> (nx) * ny);
+        std::vector<std::complex<float> > sceneSpectrum(static_cast<size_t> (nx / 2 + 1) * ny);
+        std::vector<std::complex<float> > spectrum(sceneSpectrum.size());
+        double best = std::numeric_limits<double>::max();
+        for (int run = 0; run < 3; ++run) {
+            auto start = std::chrono::steady_clock::now();
+            fft.toFrequency(space.data(), spectrum.data());
+            tbb::parallel_for(size_t(0), spectrum.size(), [&](size_t k) {
+                spectrum[k] *= sceneSpectrum[k];
+            });
+            fft.toSpace(spectrum.data(), space.data());
+            if (run > 0) {
+                best = std::min(best, seconds(std::chrono::steady_clock::now() - start));
+            }
+        }
+        return best;
+    }
+
+    /*
+     * Wall time per ring point of the direct block kernel, every ring summed at
+     * the centers of a few rows of a width-wide zero scene, rows in parallel as
+     * in the scan; best of two runs.
+     */
+    double timeDirectPoint(const Features& rings, int width, int rows) {
+        int reach = getFeaturesReach(rings) + 1;
+        rows = std::min(rows, std::max(DIRECT_SAMPLE_ROWS, 2 * tbb::task_scheduler_init::default_num_threads()));
+        Image sample(width, rows, 1, 1, 0.0f);
+        RowBands whole(0, rows, rows);
+        PaddedImage<float> padded(sample, reach, whole);
+        OffsetTable table(FeaturesVector(1, rings), padded.stride());
+        int blocks = width / SIMD_CENTERS;
+        double points = 0;
+        for (size_t i = 0; i < rings.size(); ++i) {
+            points += static_cast<double> (rings[i].size()) * blocks * SIMD_CENTERS * rows;
+        }
+        // Kept, so the sums are not optimized away.
+        std::vector<float> totals(rows);
+        double best = std::numeric_limits<double>::max();
+        for (int run = 0; run < 2; ++run) {
+            auto start = std::chrono::steady_clock::now();
+            tbb::parallel_for(0, rows, [&](int y) {
+                float sums[SIMD_CENTERS];
+                for (int block = 0; block < blocks; ++block) {
+                    for (size_t i = 0; i < rings.size(); ++i) {
+                        evalSampleBlock(table.begin(0, i), table.end(0, i), padded.at(Point(block * SIMD_CENTERS, y)), sums);
+                        totals[y] += sums[0];
+                    }
+                }
+            });
+            best = std::min(best, seconds(std::chrono::steady_clock::now() - start));
+        }
+        return points > 0 ? best / points : 0;
+    }
+}
+
+/*
+ * The padded band, its spectrum and a scratch spectrum, reused for every ring
+ * of every band.
+ */
+class RingMaps::Transform {
+public:
+
+    Transform(int ny, int nx) : nx(nx), ny(ny), fft(ny, nx), space(static_cast<size_t> (nx) * ny),
+    sceneSpectrum(static_cast<size_t> (nx / 2 + 1) * ny), spectrum(sceneSpectrum.size()) {
+    }
+
+    int nx;
+    int ny;
+    RealFFT fft;
+    std::vector<float> space;
+    std::vector<std::complex<float> > sceneSpectrum;
+    std::vector<std::complex<float> > spectrum;
+};
+
+RingMaps::RingMaps(const Image& scene, const Features& rings, const std::vector<bool>& fft, int bandRows, float (*pixel)(float)) :
+scene(scene), rings(rings), pixel(pixel), width(scene.width()), firstRow(0), reach(getRingsReach(rings, fft)), maps(rings.size()) {
+    if (boost::find(fft, true) == fft.end()) {
+        return;
+    }
+    // Band rows within reach of the centers, padded by reach zeros on every side
+    // so the circular correlation never wraps onto them.
+    int rows = std::min(bandRows + 2 * reach, scene.height());
+    transform.reset(new Transform(fftSize(rows + 2 * reach), fftSize(width + 2 * reach)));
+    if (!transform->fft.ready) {
+        transform.reset();
+        return;
+    }
+    for (size_t i = 0; i < rings.size(); ++i) {
+        if (fft[i]) {
+            maps[i].resize(static_cast<size_t> (width) * bandRows);
+        }
+    }
+}
+
+RingMaps::~RingMaps() {
+}
+
+void RingMaps::cover(RowBands& bands, int band) {
+    firstRow = bands.top(band);
+    int lastRow = bands.bottom(band);
+    if (!transform) {
+        return;
+    }
+    int top = std::max(firstRow - reach, 0);
+    int bottom = std::min(lastRow + reach, scene.height());
+    int nx = transform->nx;
+    int ny = transform->ny;
+    std::vector<float>& space = transform->space;
+    std::vector<std::complex<float> >& spectrum = transform->spectrum;
+    std::vector<std::complex<float> >& sceneSpectrum = transform->sceneSpectrum;
+    std::fill(space.begin(), space.end(), 0.0f);
+    for (int y = top; y < bottom; ++y) {
+        std::transform(scene.data(0, y), scene.data(0, y) + width, space.data() + static_cast<size_t> (y - top) * nx, pixel);
+    }
+    transform->fft.toFrequency(space.data(), sceneSpectrum.data());
+    for (size_t i = 0; i < rings.size(); ++i) {
+        if (maps[i].empty()) {
+            continue;
+        }
+        // Kernel mirrored through the origin: convolving with it correlates with the ring.
+        std::fill(space.begin(), space.end(), 0.0f);
+        boost::for_each(rings[i], [&](const Point & p) {
+            space[static_cast<size_t> ((ny - p.y) % ny) * nx + (nx - p.x) % nx] += 1;
+        });
+        transform->fft.toFrequency(space.data(), spectrum.data());
+        tbb::parallel_for(size_t(0), spectrum.size(), [&](size_t k) {
+            spectrum[k] *= sceneSpectrum[k];
+        });
+        transform->fft.toSpace(spectrum.data(), space.data());
+        bands.forBand(band, [&](const tbb::blocked_range<int>& rows) {
+            for (int y = rows.begin(); y < rows.end(); ++y) {
+                std::copy(space.data() + static_cast<size_t> (y - top) * nx, space.data() + static_cast<size_t> (y - top) * nx + width,
+                        maps[i].data() + static_cast<size_t> (y - firstRow) * width);
+            }
+        });
+    }
+}
+
+std::vector<bool> chooseRingPaths(const Features& rings, int width, int rows) {
+    const char* setting = std::getenv("AYC_RING_FFT");
+    std::string mode = setting ? setting : "";
+    std::vector<bool> fft(rings.size(), mode == "always");
+    if (mode != "auto") {
+        return fft;
+    }
+    // Priced on bands as short as if every ring were mapped, so whatever is
+    // picked, its bands are no shorter.
+    std::vector<bool> all(rings.size(), true);
+    int band = ringBandRows(all, width, rows);
+    int reach = getRingsReach(rings, all);
+    // Both paths are timed here, on this machine and at this size, rather than
+    // priced from constants: their ratio moves with the FFT library, the core
+    // count and the cache sizes.
+    double fftCost = timeRingTransform(fftSize(std::min(band + 2 * reach, rows) + 2 * reach), fftSize(width + 2 * reach));
+    if (fftCost < 0) {
+        return fft;
+    }
+    double pointCost = timeDirectPoint(rings, width, rows);
+    for (size_t i = 0; i < rings.size(); ++i) {
+        fft[i] = rings[i].size() * static_cast<double> (width) * band * pointCost > fftCost;
+    }
+    return fft;
+}
+
+int ringBandRows(const std::vector<bool>& fft, int width, int rows) {
+    size_t mapped = boost::count(fft, true);
+    if (mapped == 0) {
+        return std::max(rows, 1);
+    }
+    return std::max(1, static_cast<int> (std::min<size_t>(rows, RING_MAP_FLOATS / (mapped * width))));
+}
@@ -0,0 +1,146 @@
+#include "Server.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+    const int READ_SIZE = 4096;
+
+    bool makeAddress(const std::string& path, sockaddr_un& address) {
+        std::memset(&address, 0, sizeof (address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof (address.sun_path)) {
+            std::cerr << "Socket path too long: " << path << std::endl;
+            return false;
+        }
+        std::strcpy(address.sun_path, path.c_str());
+        return true;
+    }
+
+    bool sendAll(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t count = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0) {
+                return false;
+            }
+            sent += count;
+        }
+        return true;
+    }
+
+    class LineReader {
+    public:
+
+        LineReader(int fd) : fd(fd) {
+        }
+
+        bool next(std::string& line) {
+            size_t end;
+            while ((end = buffer.find('\n')) == std::string::npos) {
+                char chunk[READ_SIZE];
+                ssize_t count = recv(fd, chunk, sizeof (chunk), 0);
+                if (count <= 0) {
+                    return false;
+                }
+                buffer.append(chunk, count);
+            }
+            line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return true;
+        }
+
+    private:
+        int fd;
+        std::string buffer;
+    };
+}
+
+int serve(const std::string& path, const RequestHandler& handler) {
+    sockaddr_un address;
+    if (!makeAddress(path, address)) {
+        return 1;
+    }
+    // Only a leftover socket is replaced; any other file at path makes bind() fail.
+    struct stat status;
+    if (!lstat(path.c_str(), &status) && S_ISSOCK(status.st_mode)) {
+        unlink(path.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*> (&address), sizeof (address)) || listen(listener, SOMAXCONN)) {
+        std::cerr << "Cannot listen on " << path << ": " << std::strerror(errno) << std::endl;
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+    for (;;) {
+        int connection = accept(listener, 0, 0);
+        if (connection < 0) {
+            continue;
+        }
+        LineReader reader(connection);
+        std::string line;
+        while (reader.next(line) && sendAll(connection, handler(line) + "\n")) {
+        }
+        close(connection);
+    }
+}
+
+int runClient(const std::string& path, const std::string& scene, int requests) {
+    sockaddr_un address;
+    if (!makeAddress(path, address)) {
+        return 1;
+    }
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, reinterpret_cast<sockaddr*> (&address), sizeof (address))) {
+        std::cerr << "Cannot connect to " << path << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    LineReader reader(connection);
+    std::vector<long long> latencies;
+    for (int i = 0; i < requests; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        if (!sendAll(connection, scene + "\n")) {
+            break;
+        }
+        std::string line;
+        bool complete = false;
+        while (reader.next(line)) {
+            if (line.empty()) {
+                complete = true;
+                break;
+            }
+            if (i == 0) {
+                std::cout << line << std::endl;
+            }
+        }
+        if (!complete) {
+            std::cerr << "Connection closed by server" << std::endl;
+            break;
+        }
+        latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+    close(connection);
+    if (latencies.empty()) {
+        return 1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    long long total = 0;
+    for (long long latency : latencies) {
+        total += latency;
+    }
+    std::cerr << "requests: " << latencies.size() << ", mean: " << total / latencies.size() << " mcs, median: "
+            << latencies[latencies.size() / 2] << " mcs, max: " << latencies.back() << " mcs" << std::endl;
+    return 0;
+}
@@ -1,7 +1,12 @@
 #include <cassert>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
 
+#include <fstream>
 #include <iostream>
+#include <list>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -10,174 +15,285 @@
 #include <boost/range/numeric.hpp>
 #include <boost/bind.hpp>
 #include <boost/range/algorithm/sort.hpp>
-//#include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "mkl.h"
-#include <tbb/parallel_for.h>
-#include <tbb/blocked_range2d.h>
-#include <tbb/concurrent_vector.h>
 #include <tbb/task_scheduler_init.h>
 
 #define cimg_OS 0
 #include "CImg.h"
 
 #include "Core.hpp"
+#include "Loader.hpp"
+#include "Log.hpp"
+#include "Matcher.hpp"
+#include "QueryModel.hpp"
+#include "RingMaps.hpp"
+#include "Server.hpp"
 
 using namespace cimg_library;
 
-//struct Log {
-//    boost::posix_time::ptime start;
-//    Log(const char* msg) : start(boost::posix_time::microsec_clock::local_time()) {
-//        std::cout << "Log started: " << msg << std::endl;
-//    }
-//    
-//    ~Log() {
-//        std::cout << "Log end: Time - " << (boost::posix_time::microsec_clock::local_time() - start).total_microseconds() << " mcs" << std::endl; 
-//    }
-//};
-
-Image readGrayImage(const char* filename) {
-    CImg<u_char> image(filename);
-    Image gray(image.width(), image.height(), 1, 1);
-    convert2Gray(image, gray);
-    return gray;
-}
+const std::string SOCKET_PREFIX = "unix:";
 
-float getScaleRatio(const Image& i) {
-    float imageSize = i.width() * i.height();
-    if (imageSize < MAX_IMAGE_SIZE) {
-        return 1.000f;
+/*
+ * If AYC_MODEL_CACHE names a directory, the query model is kept there between
+ * runs, one file per key.
+ */
+QueryModel readQueryModel(const std::vector<std::string>& queries, float minScale, float maxScale) {
+    const char* cacheDirectory = std::getenv("AYC_MODEL_CACHE");
+    unsigned long long key = cacheDirectory ? queryModelKey(queries, minScale, maxScale) : 0;
+    if (!key) {
+        return buildQueryModel(queries, minScale, maxScale);
+    }
+    char name[32];
+    std::sprintf(name, "/%016llx.model", key);
+    std::string filename = cacheDirectory + std::string(name);
+    QueryModel model;
+    if (!loadQueryModel(filename, key, model)) {
+        model = buildQueryModel(queries, minScale, maxScale);
+        saveQueryModel(filename, key, model);
     }
-    return 1 / std::sqrt(imageSize / MAX_IMAGE_SIZE);
+    return model;
 }
 
-struct Result {
-    int queryID;
-    int x;
-    int y;
-    float corel;
+/*
+ * The query scales follow the scene's downscale ratio, so scenes of different
+ * sizes need different models. Each one is built the first time it is needed,
+ * and only the MODELS_KEPT most recently used stay in memory. A reference from
+ * get() is valid until the next call.
+ */
+class QueryModels {
+public:
+    static const size_t MODELS_KEPT = 4;
 
-    Result(int queryID, int x, int y, float corel) : queryID(queryID), x(x), y(y), corel(corel) {
-    };
+    QueryModels(const std::vector<std::string>& queries, float maxScale) : queries(queries), maxScale(maxScale) {
+    }
 
-    bool operator<(const Result& r) const {
-        return queryID < r.queryID;
+    const QueryModel& get(float ratio) {
+        auto found = boost::find_if(models, [&](const std::pair<float, QueryModel>& model) {
+            return model.first == ratio;
+        });
+        if (found != models.end()) {
+            models.splice(models.begin(), models, found);
+        } else {
+            models.push_front(std::make_pair(ratio, readQueryModel(queries, 0.5 * ratio, maxScale * ratio)));
+            if (models.size() > MODELS_KEPT) {
+                models.pop_back();
+            }
+        }
+        return models.front().second;
     }
+
+private:
+    std::vector<std::string> queries;
+    float maxScale;
+    std::list<std::pair<float, QueryModel> > models;
 };
 
-const int GRAIN_SIZE = 256;
+/*
+ * AYC_SCENE_PIXELS=u16 or u8 scans the scene stored in 16- or 8-bit fixed point
+ * instead of float.
+ */
+ScenePixels scenePixels() {
+    const char* pixels = std::getenv("AYC_SCENE_PIXELS");
+    std::string name = pixels ? pixels : "";
+    return name == "u16" ? U16_PIXELS : name == "u8" ? U8_PIXELS : FLOAT_PIXELS;
+}
+
+/*
+ * AYC_SCENE_LAYOUT=tiled stores it in square tiles instead of rows.
+ */
+SceneLayout sceneLayout() {
+    const char* layout = std::getenv("AYC_SCENE_LAYOUT");
+    return layout && std::string(layout) == "tiled" ? TILED_LAYOUT : ROW_LAYOUT;
+}
+
+/*
+ * If AYC_TILE_ROWS is a positive number, the scene is not downscaled to
+ * MAX_IMAGE_SIZE but scanned at full resolution in strips of that many rows,
+ * which bounds memory by the strip size rather than by the scene size.
+ */
+void processScene(const std::string& scene, QueryModels& models, std::ostream& out, const std::string& tag) {
+    const char* tileRows = std::getenv("AYC_TILE_ROWS");
+    int stripRows = tileRows ? std::atoi(tileRows) : 0;
+    if (stripRows > 0) {
+        const QueryModel& model = models.get(1.0f);
+        Candidates candidates;
+        readSceneStrips(scene.c_str(), stripRows, getModelRadius(model), [&](const Image& strip, int top, int firstRow, int lastRow) {
+            scanScene(strip, model, firstRow - top, lastRow - top, top, candidates, scenePixels(), sceneLayout());
+        });
+        writeResults(out, mergeResults(candidates, model), model, 1.0f, tag);
+        return;
+    }
+    float ratio;
+    Image gray = readScene(scene.c_str(), ratio);
+    const QueryModel& model = models.get(ratio);
+    writeResults(out, matchScene(gray, model, scenePixels(), sceneLayout()), model, ratio, tag);
+}
 
+/*
+ * Scans one scene with every pixel storage and layout and prints, for each, the
+ * scan time, the number of results and the share of the float row-major results
+ * it reproduces (same query within two pixels).
+ */
+int comparePixels(const std::string& scene, QueryModels& models) {
+    float ratio;
+    Image gray = readScene(scene.c_str(), ratio);
+    const QueryModel& model = models.get(ratio);
+    const char* names[] = {"float", "u16", "u8"};
+    const char* layouts[] = {"rows", "tiled"};
+    std::vector<Result> reference;
+    for (int layout = ROW_LAYOUT; layout <= TILED_LAYOUT; ++layout) {
+        for (int pixels = FLOAT_PIXELS; pixels <= U8_PIXELS; ++pixels) {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<Result> results = matchScene(gray, model, static_cast<ScenePixels> (pixels), static_cast<SceneLayout> (layout));
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            if (layout == ROW_LAYOUT && pixels == FLOAT_PIXELS) {
+                reference = results;
+            }
+            int found = boost::count_if(reference, [&](const Result & expected) {
+                return boost::find_if(results, [&](const Result & r) {
+                    return r.queryID / SCALES_NUMBER == expected.queryID / SCALES_NUMBER &&
+                            std::abs(r.x - expected.x) <= 2 && std::abs(r.y - expected.y) <= 2;
+                }) != results.end();
+            });
+            std::cout << names[pixels] << "/" << layouts[layout] << "\t" << elapsed << " mcs\t" << results.size() << " results\t" <<
+                    (reference.empty() ? 1.0f : static_cast<float> (found) / reference.size()) << " recall" << std::endl;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Times both ring paths on the scene and on its half and quarter: per distinct
+ * ring of the model, the scan's direct kernel at every pixel against ring maps
+ * built band by band (scene transforms included), with the largest difference
+ * between the two, the path chooseRingPaths() would take under the current
+ * AYC_RING_FFT and the points a sliding +1 x update would touch instead of the
+ * ring's own.
+ */
+int benchmarkRings(const std::string& scene, QueryModels& models) {
+    float ratio;
+    Image gray = readScene(scene.c_str(), ratio);
+    DistinctRings distinct(models.get(ratio).circleSet);
+    int count = distinct.rings.size();
+    for (int shrink = 1; shrink <= 4; shrink *= 2) {
+        Image image = areaResize(gray, gray.width() / shrink, gray.height() / shrink);
+        int width = image.width();
+        std::vector<bool> chosen = chooseRingPaths(distinct.rings, width, image.height());
+        RowBands whole(0, image.height(), image.height());
+        PaddedImage<float> padded(image, getFeaturesReach(distinct.rings) + 1, whole);
+        OffsetTable table(FeaturesVector(1, distinct.rings), padded.stride());
+        for (int i = 0; i < count; ++i) {
+            std::vector<float> sums(static_cast<size_t> (width) * image.height());
+            auto start = std::chrono::steady_clock::now();
+            tbb::parallel_for(0, image.height(), [&](int y) {
+                float* row = &sums[static_cast<size_t> (y) * width];
+                int x = 0;
+                for (; x + SIMD_CENTERS <= width; x += SIMD_CENTERS) {
+                    evalSampleBlock(table.begin(0, i), table.end(0, i), padded.at(Point(x, y)), row + x);
+                }
+                for (; x < width; ++x) {
+                    row[x] = evalSample(table.begin(0, i), table.end(0, i), padded.at(Point(x, y)));
+                }
+            });
+            auto direct = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            std::vector<bool> only(count, false);
+            only[i] = true;
+            int bandRows = ringBandRows(only, width, image.height());
+            float maxDiff = 0;
+            std::chrono::steady_clock::duration mapping(0);
+            start = std::chrono::steady_clock::now();
+            RingMaps maps(image, distinct.rings, only, bandRows, storedValue<float>);
+            mapping += std::chrono::steady_clock::now() - start;
+            RowBands bands(0, image.height(), bandRows);
+            for (int band = 0; band < bands.count(); ++band) {
+                start = std::chrono::steady_clock::now();
+                maps.cover(bands, band);
+                mapping += std::chrono::steady_clock::now() - start;
+                for (int y = bands.top(band); y < bands.bottom(band); ++y) {
+                    for (int x = 0; x < width; ++x) {
+                        maxDiff = std::max(maxDiff, std::abs(maps.sum(i, Point(x, y)) - sums[static_cast<size_t> (y) * width + x]));
+                    }
+                }
+            }
+            auto fft = std::chrono::duration_cast<std::chrono::microseconds>(mapping).count();
+            std::cout << width << "x" << image.height() << "\t" << getFeaturesReach(Features(1, distinct.rings[i])) << " radius\t" <<
+                    distinct.rings[i].size() << " points\t" << countSlidingPoints(distinct.rings[i]) << " sliding\t" << direct << " mcs direct\t" << fft << " mcs fft\t" <<
+                    maxDiff << " max diff\t" << (chosen[i] ? "fft" : "direct") << " chosen" << std::endl;
+        }
+    }
+    return 0;
+}
+
+/*
+ * A scene argument of the form @list (or - for stdin) runs in batch mode: every
+ * non-empty line of the list is a scene path, and its results are tagged with it.
+ * unix:path serves scene requests on that socket instead, and
+ * "client path scene [requests]" sends them to a running server.
+ * "pixels threads maxScale scene queries..." runs comparePixels() on the scene,
+ * "rings ..." with the same arguments benchmarkRings().
+ */
 int main(int argc, char** argv) {
+    if (argc >= 4 && std::string(argv[1]) == "client") {
+        return runClient(argv[2], argv[3], argc > 4 ? std::atoi(argv[4]) : 1);
+    }
+    std::string benchmark = argc >= 6 ? argv[1] : "";
+    if (benchmark == "pixels" || benchmark == "rings") {
+        --argc;
+        ++argv;
+    } else {
+        benchmark.clear();
+    }
     if (argc < 5) return 0;
     int maxThreads = std::atoi(argv[1]);
     float maxScale = std::atof(argv[2]);
-    CImg<u_char> image(argv[3]);
-    float ratio = getScaleRatio(image);
-    int scaleRatio = std::floor(ratio * 100);
-    Image gray = readGrayImage(argv[3]).resize(-scaleRatio, -scaleRatio).blur(BLUR);
     tbb::task_scheduler_init tsch(tbb::task_scheduler_init::deferred);
     if (maxThreads > 0) {
         tsch.initialize(maxThreads);
     } else {
         tsch.initialize();
     }
-    tbb::concurrent_vector<Result> thirdGrade;
-    std::vector<Result> finalResult;
-
-    std::vector<Image> queryScales;
-    boost::for_each(boost::irange(4, argc), [&](int i) {
-        Image query = readGrayImage(argv[i]);
-        generateScales(query, 0.5 * ratio, maxScale * ratio, std::back_inserter(queryScales));
-    });
-    auto QUERY_NUMBER = argc - 4;
-    auto QUERY_SCALES_NUMBER = queryScales.size();
-
-    std::vector < std::vector<Image> > queryRotations(QUERY_SCALES_NUMBER);
-
-    FeaturesVector circleSet(QUERY_SCALES_NUMBER, Features(CIRCLES_NUMBER));
-    FeaturesVector radianSet(QUERY_SCALES_NUMBER, Features(ROTATIONS_NUMBER));
-    FeaturesVector pointSet(QUERY_SCALES_NUMBER, Features(ROTATIONS_NUMBER));
-
-    Descriptors queryCircleDescriptors(QUERY_SCALES_NUMBER, Descriptor(CIRCLES_NUMBER));
-    std::vector<Descriptors> queryRadianDescriptorVector(QUERY_SCALES_NUMBER, Descriptors(ROTATIONS_NUMBER));
-    std::vector<Descriptors> queryTemplateDescriptorVector(QUERY_SCALES_NUMBER, Descriptors(ROTATIONS_NUMBER));
-
-    generateQueryRotations(queryScales, std::begin(queryRotations));
-    boost::for_each(queryScales, [](Image & q) {
-        q = q.blur(BLUR);
-    });
-
-    generateCirclesSet(queryScales, std::begin(circleSet));
-    generateRadianSet(queryScales, std::begin(radianSet));
-    generatePointSet(queryRotations, std::begin(pointSet));
-
-    evalQueryDescriptors(circleSet, std::begin(queryScales), std::begin(queryCircleDescriptors));
-    evalQueryRadianDescriptorsVector(radianSet, std::begin(queryScales), std::begin(queryRadianDescriptorVector));
-    evalQueryTemplateDescriptors(pointSet, std::begin(queryRotations), std::begin(queryTemplateDescriptorVector));
-
-    auto avg = [](const Points& points, const Point& center, const Image & image) {
-        return evalSample(points, center, image);
-    };
-
-    auto TemplateFilter = [&](const Point& center, int probableScale, int probableRotation) {
-        auto i = queryRotations[probableScale][probableRotation];
-        auto r = std::max(i.width(), i.height()) / 2;
-        if (!isFitImage(r, gray, center)) {
-            return;
-        }
-        Descriptor templateDescriptor;
-        evalPointDescriptor(pointSet[probableScale][probableRotation], center, gray, std::back_inserter(templateDescriptor));
-        auto cor = evalCorrelation(templateDescriptor, queryTemplateDescriptorVector[probableScale][probableRotation]);
-        if (cor > TEMPLATE_FILTER_THRESHOLD) {
-            thirdGrade.push_back(Result(probableScale, center.x, center.y, cor));
-        }
-    };
-
-    auto RadianFilter = [&](const Point& center, int probableScale) {
-        Descriptor radianDescriptor(ROTATIONS_NUMBER);
-        std::vector<float> correlations(ROTATIONS_NUMBER);
-        evalFeaturesSampleDescriptor(radianSet[probableScale], gray, center, std::begin(radianDescriptor), avg);
-        boost::transform(queryRadianDescriptorVector[probableScale], std::begin(correlations), boost::bind(evalCorrelation, _1, boost::cref(radianDescriptor)));
-        auto min = boost::max_element(correlations);
-        if (*min > RADIAN_FILTER_THRESHOLD) {
-            TemplateFilter(center, probableScale, min - std::begin(correlations));
-        }
-    };
-
-    auto CircleFilter = [&](const Point & center) {
-        Descriptors circleDescriptors(QUERY_SCALES_NUMBER, Descriptor(CIRCLES_NUMBER));
-        std::vector<float> correlations(QUERY_SCALES_NUMBER);
-        evalDescriptors(circleSet, gray, center, std::begin(circleDescriptors), avg);
-        boost::transform(queryCircleDescriptors, circleDescriptors, std::begin(correlations), boost::bind(evalCorrelation, _1, _2));
-        auto min = boost::max_element(correlations);
-        if (*min > CIRCLE_FILTER_THRESHOLD) {
-            RadianFilter(center, min - std::begin(correlations));
+    QueryModels models(std::vector<std::string>(argv + 4, argv + argc), maxScale);
+    std::string scene = argv[3];
+    if (benchmark == "pixels") {
+        return comparePixels(scene, models);
+    }
+    if (benchmark == "rings") {
+        return benchmarkRings(scene, models);
+    }
+    if (!scene.compare(0, SOCKET_PREFIX.size(), SOCKET_PREFIX)) {
+        return serve(scene.substr(SOCKET_PREFIX.size()), [&](const std::string & request) {
+            std::ostringstream out;
+            try {
+                processScene(request, models, out, "");
+            } catch (const std::exception& e) {
+                out << "error\t" << e.what() << std::endl;
+            }
+            return out.str();
+        });
+    }
+    if (scene != "-" && scene[0] != '@') {
+        processScene(scene, models, std::cout, "");
+        return 0;
+    }
+    std::ifstream list;
+    if (scene != "-") {
+        list.open(scene.c_str() + 1);
+        if (!list) {
+            std::cerr << "Cannot open scene list " << scene.c_str() + 1 << std::endl;
+            return 1;
         }
-    };
-
-    tbb::parallel_for(tbb::blocked_range2d<size_t>(0, gray.width(), GRAIN_SIZE, 0, gray.height(), GRAIN_SIZE),
-            [&](const tbb::blocked_range2d<size_t>& rng) {
-                boost::for_each(boost::irange(rng.rows().begin(), rng.rows().end()), [&](size_t i) {
-                    boost::for_each(boost::irange(rng.cols().begin(), rng.cols().end()), [&](size_t j) {
-                        CircleFilter(Point(i, j));
-                    });
-                });
-            });
-    boost::for_each(thirdGrade, [&](const Result & candidate) {
-        auto f = boost::find_if(finalResult, boost::bind<bool>([&](const Result & result) {
-            return (std::abs(candidate.x - result.x) < (queryScales[candidate.queryID].width() + queryScales[result.queryID].width()) / 2) &&
-                    (std::abs(candidate.y - result.y) < (queryScales[candidate.queryID].height() + queryScales[result.queryID].height()) / 2);
-        }, _1));
-        if (f != finalResult.end() && f -> corel > candidate.corel) {
-            *f = candidate;
+    }
+    std::istream& in = scene == "-" ? std::cin : list;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
         }
-        if (f == finalResult.end()) {
-            finalResult.push_back(candidate);
+        try {
+            processScene(line, models, std::cout, line);
+        } catch (const std::exception& e) {
+            std::cerr << line << ": " << e.what() << std::endl;
         }
-    });
-    boost::sort(finalResult);
-    boost::for_each(finalResult, [&](const Result & r) {
-        std::cout << 1 + r.queryID / QUERY_SCALES_NUMBER << "\t" << (int) std::floor(r.x / ratio) << "\t" << (int) std::floor(r.y / ratio) << std::endl;
-    });
+    }
 }
-